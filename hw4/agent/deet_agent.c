@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "agent_shm.h"
+
+/*
+ * In-process agent, loaded with LD_PRELOAD by run --agent.
+ *
+ * Maps the region deet passed in DEET_AGENT_FD and keeps it current: a
+ * heartbeat thread ticks every DEET_AGENT_HEARTBEAT_MS milliseconds,
+ * the allocation functions count calls, and AGENT_BT_SIGNAL makes the
+ * thread that takes it record its own backtrace.  Without the variable,
+ * the library only forwards to the C library.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static AgentShm *shm;
+
+#define COUNT(field, n) __atomic_fetch_add(&shm->field, (n), __ATOMIC_RELAXED)
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void *malloc(size_t size) {
+    if (shm != NULL) {
+        COUNT(mallocs, 1);
+        COUNT(bytes_requested, size);
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    if (shm != NULL) {
+        COUNT(callocs, 1);
+        COUNT(bytes_requested, n * size);
+    }
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (shm != NULL) {
+        COUNT(reallocs, 1);
+        COUNT(bytes_requested, size);
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (shm != NULL && ptr != NULL) COUNT(frees, 1);
+    __libc_free(ptr);
+}
+
+/*
+ * backtrace() was called once at load time, so the unwinder is already
+ * loaded and it no longer allocates here.
+ */
+static void bt_handler(int sig) {
+    if (shm == NULL) return;
+    int saved = errno;
+    void *frames[AGENT_BT_DEPTH + 1];
+    int n = backtrace(frames, AGENT_BT_DEPTH + 1);
+
+    __atomic_fetch_add(&shm->bt_seq, 1, __ATOMIC_ACQ_REL);
+    // Leave out the handler's own frame
+    shm->bt_depth = n > 1 ? n - 1 : 0;
+    for (int i = 1; i < n; i++) shm->bt[i - 1] = (uintptr_t)frames[i];
+    shm->bt_ns = mono_ns();
+    shm->bt_tid = syscall(SYS_gettid);
+    shm->bt_requests++;
+    __atomic_fetch_add(&shm->bt_seq, 1, __ATOMIC_ACQ_REL);
+    errno = saved;
+}
+
+static void *heartbeat(void *arg) {
+    struct timespec period;
+    period.tv_sec = shm->heartbeat_ms / 1000;
+    period.tv_nsec = (shm->heartbeat_ms % 1000) * 1000000L;
+    for (;;) {
+        __atomic_store_n(&shm->heartbeat_ns, mono_ns(), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&shm->heartbeats, 1, __ATOMIC_RELEASE);
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * A forked child would count into its parent's region, under the
+ * parent's pid, so it lets go of it.  Children started with vfork() or a
+ * raw clone() do not run this and still count there until they exec.
+ */
+static void agent_forked(void) {
+    AgentShm *p = shm;
+    shm = NULL;
+    munmap(p, sizeof(AgentShm));
+}
+
+__attribute__((constructor)) static void agent_init(void) {
+    const char *fd_str = getenv(AGENT_FD_ENV);
+    if (fd_str == NULL) return;
+    int fd = atoi(fd_str);
+    // Processes this one starts inherit LD_PRELOAD but not the region
+    unsetenv(AGENT_FD_ENV);
+
+    AgentShm *p = mmap(NULL, sizeof(AgentShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return;
+
+    const char *ms = getenv(AGENT_HEARTBEAT_ENV);
+    p->heartbeat_ms = ms != NULL && atoi(ms) > 0 ? atoi(ms) : AGENT_HEARTBEAT_MS;
+    p->pid = getpid();
+    p->version = AGENT_VERSION;
+    shm = p;
+
+    void *warm[1];
+    backtrace(warm, 1);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = bt_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(AGENT_BT_SIGNAL, &sa, NULL);
+
+    // Keep the backtrace signal for the application's threads
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    sigaddset(&mask, AGENT_BT_SIGNAL);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, heartbeat, NULL) == 0) pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_atfork(NULL, NULL, agent_forked);
+
+    __atomic_store_n(&p->magic, AGENT_MAGIC, __ATOMIC_RELEASE);
+}
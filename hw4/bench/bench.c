@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <stdbool.h>
+#include "helper.h"
+#include "trace.h"
+#include "deet_run.h"
+#include "strbuf.h"
+#include "deet.h"
+
+/*
+ * Microbenchmarks for deet's hot paths.
+ *
+ * Each benchmark drives the same code deet runs for the corresponding
+ * command: deet_command() itself for run and cont, with the report the
+ * kernel sends back reaped through the SIGCHLD signalfd and
+ * sigchld_fd_event(), as deet's event loop does; process_vm_readv() for
+ * monitor; PTRACE_PEEKDATA/POKEDATA and a frame walk over testprog/tp
+ * for peek, poke and bt, on a process seized and paused with
+ * trace_seize() and trace_pause(); and PTRACE_SEIZE/INTERRUPT/CONT for
+ * attach and for pausing a seized process.  Per-operation latencies are
+ * written as a single JSON object so successive runs can be compared
+ * mechanically.  Any failing call ends the run, so a number is never
+ * reported for work that did not happen.
+ */
+
+#define DEFAULT_ITERS 200
+#define DEFAULT_REAP 64
+#define BENCH_BUF_SIZE (64 * 1024)
+#define TP_PATH "bin/tp"
+#define MAX_FRAMES 64
+
+typedef struct {
+    const char *name;
+    uint64_t *samples; // Per-operation latency, ns
+    int count;
+    uint64_t units; // Bytes moved or children reaped, for throughput
+    uint64_t total_ns; // Wall time covered by the benchmark
+} BenchResult;
+
+// monitor_read, peek and poke target: identical address in the forked child.
+static char bench_buf[BENCH_BUF_SIZE];
+
+static int iters = DEFAULT_ITERS;
+static int reap_count = DEFAULT_REAP;
+static const char *tp_path = TP_PATH;
+static int sigchld_fd = -1;
+static FILE *err_out; // stderr before it is silenced
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Report a failed call, with errno unless it is 0, and stop, taking down
+ * the children in the table so none is left stopped behind.
+ */
+static void fail(const char *what) {
+    if (errno != 0) fprintf(err_out, "bench: %s: %s\n", what, strerror(errno));
+    else fprintf(err_out, "bench: %s\n", what);
+    for (int i = 0; i < ptable.count; i++) {
+        if (ptable.state[i] != PSTATE_DEAD) kill(ptable.pid[i], SIGKILL);
+    }
+    exit(EXIT_FAILURE);
+}
+
+static void result_init(BenchResult *r, const char *name, int n) {
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    if ((r->samples = calloc(n > 0 ? n : 1, sizeof(uint64_t))) == NULL) fail("calloc");
+}
+
+static void result_add(BenchResult *r, uint64_t ns) {
+    r->samples[r->count++] = ns;
+    r->total_ns += ns;
+}
+
+static uint64_t percentile(BenchResult *r, int pct) {
+    if (r->count == 0) return 0;
+    int idx = (int)(((uint64_t)r->count * pct + 99) / 100) - 1;
+    if (idx < 0) idx = 0;
+    return r->samples[idx];
+}
+
+/*
+ * Block until sigchld_fd_event() has moved the table entry for pid into
+ * the wanted state, reading SIGCHLD from the signalfd as deet's event
+ * loop does.
+ */
+static void wait_for_state(pid_t pid, PSTATE want) {
+    for (;;) {
+        int i = ptable_find(pid);
+        if (i != -1 && ptable.state[i] == want) return;
+        struct pollfd p = { .fd = sigchld_fd, .events = POLLIN };
+        if (poll(&p, 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            fail("poll");
+        }
+        sigchld_fd_event(sigchld_fd, p.revents, NULL);
+    }
+}
+
+/*
+ * Block until sigchld_fd_event() has reaped a report, for changes that
+ * deet records in the table before the kernel has made them, as run and
+ * cont do.  Each is made with no other report outstanding, so the first
+ * SIGCHLD is the one for it.
+ */
+static void wait_report(void) {
+    struct pollfd p = { .fd = sigchld_fd, .events = POLLIN };
+    while (poll(&p, 1, -1) == -1) {
+        if (errno != EINTR) fail("poll");
+    }
+    sigchld_fd_event(sigchld_fd, p.revents, NULL);
+}
+
+/*
+ * Hand a command line to deet_command(), as the prompt or a client
+ * does, and wait for the report of what it did.
+ */
+static void command(const char *line) {
+    static StrBuf out;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", line);
+    if (deet_command(buf, &out, NULL) != CMD_OK) {
+        errno = 0;
+        fail(line);
+    }
+    sb_clear(&out);
+    wait_report();
+}
+
+// waitpid() for one specific report, failing on anything else
+static void wait_child(pid_t pid, int options, bool stopped) {
+    int status;
+    pid_t rc;
+    while ((rc = waitpid(pid, &status, options)) == -1 && errno == EINTR);
+    if (rc == -1) fail("waitpid");
+    if (stopped ? !WIFSTOPPED(status) : !WIFCONTINUED(status)) {
+        errno = 0;
+        fail(stopped ? "waitpid: child did not stop" : "waitpid: child did not continue");
+    }
+}
+
+static int table_add(pid_t pid, const char *cmd) {
+    char *argv[] = {(char *)cmd, NULL};
+    int id = ptable_add(pid, 1, argv);
+    if (id == -1) {
+        kill(pid, SIGKILL);
+        fail("ptable_add");
+    }
+    return id;
+}
+
+static pid_t fork_child(void) {
+    pid_t pid = fork();
+    if (pid == -1) fail("fork");
+    return pid;
+}
+
+static void signal_child(pid_t pid, int sig) {
+    if (kill(pid, sig) == -1) fail("kill");
+}
+
+static void do_ptrace(enum __ptrace_request req, pid_t pid, long data, const char *what) {
+    if (ptrace(req, pid, NULL, (void *)data) == -1) fail(what);
+}
+
+/*
+ * Start a child the way run does: fork, exec, and SIGSTOP it from the
+ * parent without tracing it.  If argv is NULL the child stays a copy of
+ * this process, for the benchmarks that read and write its memory.
+ * Returns with the table entry stopped; the kernel may not have stopped
+ * the child yet.
+ */
+static pid_t spawn(char *const argv[]) {
+    pid_t pid = fork_child();
+    if (pid == 0) {
+        if (argv == NULL) {
+            for (;;) pause();
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int id = table_add(pid, argv ? argv[0] : "bench");
+    signal_child(pid, SIGSTOP);
+    ptable_set_state(id, PSTATE_STOPPED);
+    return pid;
+}
+
+static void kill_child(pid_t pid) {
+    signal_child(pid, SIGKILL);
+    wait_for_state(pid, PSTATE_DEAD);
+}
+
+/*
+ * run as a whole: deet_command() forks, records and stops the child, and
+ * the launch is over once the stop has been reaped.
+ */
+static void bench_run(BenchResult *r) {
+    result_init(r, "run_spawn", iters);
+    for (int i = 0; i < iters; i++) {
+        uint64_t t0 = now_ns();
+        command("run sleep 1000");
+        result_add(r, now_ns() - t0);
+        kill_child(ptable.pid[0]);
+        ptable_clear();
+    }
+}
+
+/*
+ * cont is deet_command() until its continue is reaped.  deet has no stop
+ * command yet, so a stop is SIGSTOP until sigchld_fd_event() has moved
+ * the table entry from stopping to stopped.
+ */
+static void bench_stop_cont(BenchResult *stop, BenchResult *cont) {
+    result_init(stop, "stop_roundtrip", iters);
+    result_init(cont, "cont_roundtrip", iters);
+    command("run sleep 1000");
+    pid_t pid = ptable.pid[0];
+    for (int i = 0; i < iters; i++) {
+        uint64_t t0 = now_ns();
+        command("cont 0");
+        result_add(cont, now_ns() - t0);
+
+        t0 = now_ns();
+        signal_child(pid, SIGSTOP);
+        ptable_set_state(0, PSTATE_STOPPING);
+        wait_for_state(pid, PSTATE_STOPPED);
+        result_add(stop, now_ns() - t0);
+    }
+    kill_child(pid);
+    ptable_clear();
+}
+
+/*
+ * N children block on a shared pipe; closing the write end makes them all
+ * exit at once and sigchld_fd_event() has to reap the whole burst.
+ */
+static void bench_reap(BenchResult *r) {
+    int rounds = iters / 10 > 0 ? iters / 10 : 1;
+    result_init(r, "reap", rounds);
+    for (int round = 0; round < rounds; round++) {
+        int fds[2];
+        if (pipe(fds) == -1) fail("pipe");
+        for (int i = 0; i < reap_count; i++) {
+            pid_t pid = fork_child();
+            if (pid == 0) {
+                char c;
+                close(fds[1]);
+                while (read(fds[0], &c, 1) == -1 && errno == EINTR);
+                _exit(0);
+            }
+            table_add(pid, "reap");
+        }
+        close(fds[0]);
+
+        uint64_t t0 = now_ns();
+        close(fds[1]);
+        for (int i = 0; i < ptable.count; i++) {
+            wait_for_state(ptable.pid[i], PSTATE_DEAD);
+        }
+        result_add(r, now_ns() - t0);
+        r->units += ptable.count;
+        ptable_clear();
+    }
+}
+
+static void bench_monitor(BenchResult *r) {
+    result_init(r, "monitor_read", iters);
+    static char copy[BENCH_BUF_SIZE];
+    pid_t pid = spawn(NULL);
+    struct iovec local = { copy, BENCH_BUF_SIZE };
+    struct iovec remote = { bench_buf, BENCH_BUF_SIZE };
+    for (int i = 0; i < iters; i++) {
+        uint64_t t0 = now_ns();
+        ssize_t n = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+        result_add(r, now_ns() - t0);
+        if (n != BENCH_BUF_SIZE) {
+            if (n >= 0) errno = EFAULT;
+            fail("process_vm_readv");
+        }
+        r->units += BENCH_BUF_SIZE;
+    }
+    kill_child(pid);
+    ptable_clear();
+}
+
+/*
+ * Seize a stopped table entry and hold it in a ptrace stop, as deet does
+ * before it touches a process's memory or registers.
+ */
+static void seize_stopped(int id) {
+    int sig;
+    if (trace_seize(id, false) == -1) fail("trace_seize");
+    if (trace_pause(id, &sig) == -1) fail("trace_pause");
+}
+
+/*
+ * peek and poke: the whole buffer a word at a time, through
+ * PTRACE_PEEKDATA and PTRACE_POKEDATA.
+ */
+static void bench_peek_poke(BenchResult *peek, BenchResult *poke) {
+    result_init(peek, "peek", iters);
+    result_init(poke, "poke", iters);
+    pid_t pid = spawn(NULL);
+    seize_stopped(0);
+    for (int i = 0; i < iters; i++) {
+        uint64_t t0 = now_ns();
+        for (size_t off = 0; off < BENCH_BUF_SIZE; off += sizeof(long)) {
+            errno = 0;
+            long word = ptrace(PTRACE_PEEKDATA, pid, bench_buf + off, NULL);
+            if (word == -1 && errno != 0) fail("PTRACE_PEEKDATA");
+        }
+        result_add(peek, now_ns() - t0);
+        peek->units += BENCH_BUF_SIZE;
+
+        t0 = now_ns();
+        for (size_t off = 0; off < BENCH_BUF_SIZE; off += sizeof(long)) {
+            if (ptrace(PTRACE_POKEDATA, pid, bench_buf + off, (void *)(long)off) == -1) fail("PTRACE_POKEDATA");
+        }
+        result_add(poke, now_ns() - t0);
+        poke->units += BENCH_BUF_SIZE;
+    }
+    kill_child(pid);
+    ptable_clear();
+}
+
+/*
+ * bt: the registers, then the frame pointer chain, of testprog/tp once it
+ * has stopped itself in e(), five calls below main().
+ */
+static void bench_bt(BenchResult *r) {
+    result_init(r, "bt", iters);
+#if defined(__x86_64__)
+    if (access(tp_path, X_OK) == -1) fail(tp_path);
+    char line[256];
+    snprintf(line, sizeof(line), "run %s", tp_path);
+    command(line);
+    pid_t pid = ptable.pid[0];
+    command("cont 0");
+    wait_for_state(pid, PSTATE_STOPPED);
+    seize_stopped(0);
+
+    for (int i = 0; i < iters; i++) {
+        uint64_t t0 = now_ns();
+        struct user_regs_struct regs;
+        if (ptrace(PTRACE_GETREGS, pid, NULL, &regs) == -1) fail("PTRACE_GETREGS");
+        unsigned long fp = regs.rbp;
+        int depth = 0;
+        while (depth < MAX_FRAMES && fp != 0) {
+            errno = 0;
+            unsigned long next = ptrace(PTRACE_PEEKDATA, pid, (void *)fp, NULL);
+            if (errno != 0) break;
+            errno = 0;
+            ptrace(PTRACE_PEEKDATA, pid, (void *)(fp + sizeof(long)), NULL);
+            if (errno != 0) break;
+            depth++;
+            if (next <= fp) break;
+            fp = next;
+        }
+        result_add(r, now_ns() - t0);
+        if (depth < 5) {
+            errno = 0;
+            fail("bt: tp has no frame pointer chain");
+        }
+    }
+    kill_child(pid);
+    ptable_clear();
+#else
+    fprintf(err_out, "bench: bt is only implemented on x86_64, skipping\n");
+#endif
+}
+
+/*
+ * attach: seize a running process and interrupt it, as trace_attach()
+ * does, until the interrupt stop is reported.  pause: PTRACE_INTERRUPT
+ * and PTRACE_CONT on a seized process, the round trip behind
+ * trace_pause() and trace_resume().
+ */
+static void bench_ptrace(BenchResult *attach, BenchResult *pause_rt) {
+    char *argv[] = {"sleep", "1000", NULL};
+    result_init(attach, "attach", iters);
+    result_init(pause_rt, "pause_resume", iters);
+    pid_t pid = spawn(argv);
+    wait_child(pid, WUNTRACED, true);
+    signal_child(pid, SIGCONT);
+    wait_child(pid, WCONTINUED, false);
+
+    for (int i = 0; i < iters; i++) {
+        uint64_t t0 = now_ns();
+        do_ptrace(PTRACE_SEIZE, pid, 0, "PTRACE_SEIZE");
+        do_ptrace(PTRACE_INTERRUPT, pid, 0, "PTRACE_INTERRUPT");
+        wait_child(pid, __WALL, true);
+        result_add(attach, now_ns() - t0);
+        do_ptrace(PTRACE_DETACH, pid, 0, "PTRACE_DETACH");
+    }
+
+    do_ptrace(PTRACE_SEIZE, pid, 0, "PTRACE_SEIZE");
+    for (int i = 0; i < iters; i++) {
+        uint64_t t0 = now_ns();
+        do_ptrace(PTRACE_INTERRUPT, pid, 0, "PTRACE_INTERRUPT");
+        wait_child(pid, __WALL, true);
+        do_ptrace(PTRACE_CONT, pid, 0, "PTRACE_CONT");
+        result_add(pause_rt, now_ns() - t0);
+    }
+    do_ptrace(PTRACE_INTERRUPT, pid, 0, "PTRACE_INTERRUPT");
+    wait_child(pid, __WALL, true);
+    do_ptrace(PTRACE_DETACH, pid, 0, "PTRACE_DETACH");
+    kill_child(pid);
+    ptable_clear();
+}
+
+static void print_result(FILE *out, BenchResult *r, bool last) {
+    qsort(r->samples, r->count, sizeof(uint64_t), cmp_u64);
+    double secs = r->total_ns / 1e9;
+    fprintf(out, "    \"%s\": {\"samples\": %d, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                 "\"max_ns\": %llu, \"ops_per_sec\": %.1f",
+            r->name, r->count,
+            (unsigned long long)percentile(r, 50),
+            (unsigned long long)percentile(r, 99),
+            (unsigned long long)(r->count ? r->samples[r->count - 1] : 0),
+            secs > 0 ? r->count / secs : 0.0);
+    if (r->units != 0) {
+        fprintf(out, ", \"units_per_sec\": %.1f", secs > 0 ? r->units / secs : 0.0);
+    }
+    fprintf(out, "}%s\n", last ? "" : ",");
+    free(r->samples);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n iterations] [-r reap_children] [-t testprog] [-o output.json] [-v]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *outfile = NULL;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:t:o:v")) != -1) {
+        switch (opt) {
+            case 'n':
+                iters = atoi(optarg);
+                break;
+            case 'r':
+                reap_count = atoi(optarg);
+                break;
+            case 't':
+                tp_path = optarg;
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (iters <= 0 || reap_count <= 0) usage(argv[0]);
+
+    // sigchld_fd_event() logs every transition; keep that out of the way.
+    int saved = dup(STDERR_FILENO);
+    if (saved == -1 || (err_out = fdopen(saved, "w")) == NULL) {
+        perror("stderr");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(err_out, NULL, _IONBF, 0);
+    if (!verbose) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull != -1) {
+            dup2(devnull, STDERR_FILENO);
+            close(devnull);
+        }
+    }
+
+    if ((sigchld_fd = sigchld_fd_open()) == -1) fail("signalfd");
+
+    BenchResult results[10];
+    bench_run(&results[0]);
+    bench_stop_cont(&results[1], &results[2]);
+    bench_reap(&results[3]);
+    bench_monitor(&results[4]);
+    bench_peek_poke(&results[5], &results[6]);
+    bench_bt(&results[7]);
+    bench_ptrace(&results[8], &results[9]);
+
+    FILE *out = stdout;
+    if (outfile != NULL && (out = fopen(outfile, "w")) == NULL) fail(outfile);
+    fprintf(out, "{\n  \"iterations\": %d,\n  \"reap_children\": %d,\n  \"results\": {\n",
+            iters, reap_count);
+    int n = sizeof(results) / sizeof(results[0]);
+    for (int i = 0; i < n; i++) {
+        print_result(out, &results[i], i == n - 1);
+    }
+    fprintf(out, "  }\n}\n");
+    int err = ferror(out);
+    if (out != stdout && fclose(out) != 0) err = 1;
+    if (err) fail(outfile != NULL ? outfile : "stdout");
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef AGENT_H
+#define AGENT_H
+
+#include "strbuf.h"
+
+/*
+ * deet's side of the in-process agent for run --agent (see agent_shm.h).
+ * The library is looked for in $DEET_AGENT_LIB, then next to the deet
+ * executable.
+ */
+
+typedef struct {
+    int fd; // memfd holding the shared region, -1 once handed over
+    char *lib; // Path of the agent library
+} AgentLaunch;
+
+int agent_prepare(AgentLaunch *launch);
+
+void agent_child(AgentLaunch *launch);
+
+int agent_start(int deet_id, AgentLaunch *launch);
+
+void agent_abort(AgentLaunch *launch);
+
+int agent_print(int deet_id, StrBuf *out);
+
+int agent_backtrace(int deet_id, StrBuf *out);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef AGENT_SHM_H
+#define AGENT_SHM_H
+
+#include <stdint.h>
+
+/*
+ * Layout of the region shared between deet and the in-process agent
+ * (bin/libdeetagent.so, loaded into processes started with run --agent).
+ *
+ * deet creates the region as a memfd and passes it to the agent through
+ * the environment; the agent maps it writable and deet maps it read-only,
+ * so reading it is a plain load and never disturbs the process.  Counters
+ * are only ever incremented.  The backtrace is guarded by a sequence
+ * count that is odd while the agent is writing it.
+ *
+ * The region belongs to one process image: a forked child lets go of it,
+ * and after an exec it is no longer mapped, so deet checks
+ * /proc/<pid>/maps before trusting it or sending AGENT_BT_SIGNAL.
+ */
+
+#define AGENT_MAGIC 0x61746564 // "deta"
+#define AGENT_VERSION 1
+#define AGENT_FD_ENV "DEET_AGENT_FD"
+#define AGENT_HEARTBEAT_ENV "DEET_AGENT_HEARTBEAT_MS"
+#define AGENT_HEARTBEAT_MS 100
+#define AGENT_BT_DEPTH 32
+
+// Signal asking the agent for a backtrace of the thread that takes it
+#define AGENT_BT_SIGNAL (SIGRTMIN + 4)
+
+typedef struct {
+    uint32_t magic; // Written last by the agent once it is running
+    uint32_t version;
+    int32_t pid; // As the agent sees it; deet only signals the pid in its table
+    uint32_t heartbeat_ms;
+
+    uint64_t heartbeats; // Ticks of the agent's heartbeat thread
+    uint64_t heartbeat_ns; // CLOCK_MONOTONIC time of the last tick
+
+    uint64_t mallocs;
+    uint64_t callocs;
+    uint64_t reallocs;
+    uint64_t frees; // free() of non-NULL pointers
+    uint64_t bytes_requested; // Sum of sizes asked for
+
+    uint32_t bt_seq; // Odd while the backtrace is being written
+    uint32_t bt_depth;
+    uint64_t bt_ns; // CLOCK_MONOTONIC time the backtrace was taken
+    int32_t bt_tid;
+    uint32_t bt_requests; // Backtrace signals handled
+    uint64_t bt[AGENT_BT_DEPTH];
+} AgentShm;
+
+#endif
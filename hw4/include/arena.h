@@ -0,0 +1,26 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_NONE ((size_t)-1)
+
+/*
+ * Append-only byte arena.  Entries are addressed by offset rather than by
+ * pointer so the backing buffer can move when it grows.
+ */
+typedef struct {
+    char *base;
+    size_t used;
+    size_t capacity;
+} Arena;
+
+size_t arena_append(Arena *arena, const void *data, size_t len);
+
+size_t arena_append_str(Arena *arena, const char *str);
+
+static inline char *arena_at(Arena *arena, size_t offset) {
+    return arena->base + offset;
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "strbuf.h"
+
+/*
+ * Output capture for processes started with run --capture.
+ *
+ * The child's stdout and stderr are pipes.  Whatever arrives is tee()d
+ * into a per-process ring (itself a pipe, so it never holds more than
+ * CAPTURE_RING_SIZE bytes) and then splice()d into the process's log
+ * file, so the data never passes through deet's address space on the
+ * way.  Each readiness event moves at most CAPTURE_BUDGET bytes per
+ * stream; a chatty child just fills its pipe and blocks.
+ *
+ * The log file is closed when both streams reach end of file, and once
+ * the process has also exited the ring's contents are kept in memory
+ * instead, so a finished capture holds no descriptors.
+ */
+
+#define CAPTURE_RING_SIZE (64 * 1024)
+#define CAPTURE_BUDGET (64 * 1024)
+
+typedef struct {
+    int out[2]; // stdout pipe
+    int err[2]; // stderr pipe
+} CapturePipes;
+
+int capture_prepare(CapturePipes *pipes);
+
+void capture_child(CapturePipes *pipes);
+
+int capture_start(int deet_id, CapturePipes *pipes);
+
+void capture_abort(CapturePipes *pipes);
+
+void capture_exit(int deet_id);
+
+int capture_output(int deet_id, int tail_lines, StrBuf *out);
+
+#endif
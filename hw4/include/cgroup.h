@@ -0,0 +1,44 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdbool.h>
+#include "strbuf.h"
+
+/*
+ * Process groups for run --group.
+ *
+ * When a cgroup v2 hierarchy is writable, each group is a cgroup under a
+ * deet-owned subtree, <deet's cgroup>/deet-<pid>/<group>.  A group is then
+ * frozen or thawed with a single write to its cgroup.freeze, however many
+ * processes it holds, and completion is read from its cgroup.events
+ * instead of from one SIGCHLD per process.  Its cpu.stat and
+ * memory.current come for free.  Without cgroups, groups are plain lists
+ * and freeze/thaw fall back to one signal per member.
+ *
+ * A process launched into a group starts stopped, like any other, without
+ * disturbing the members already there: in a frozen group the freezer
+ * holds it, so members start together with thaw.
+ */
+
+typedef struct {
+    int group; // Group index, or -1
+    int procs_fd; // Group's cgroup.procs for the child to join, or -1
+} GroupLaunch;
+
+int group_prepare(const char *name, GroupLaunch *launch);
+
+void group_child(GroupLaunch *launch);
+
+void group_start(int deet_id, GroupLaunch *launch);
+
+void group_abort(GroupLaunch *launch);
+
+bool group_frozen(int deet_id);
+
+int group_freeze(const char *name, bool freeze);
+
+void group_list(StrBuf *out);
+
+void group_cleanup(void);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef COVER_H
+#define COVER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "strbuf.h"
+
+/*
+ * Code coverage with one-shot breakpoints.
+ *
+ * cover_start() plants an int3 at the start of every basic block in a
+ * module of a process.  The functions come from the ELF symbol table of
+ * the file it was mapped from, and are split into blocks by decoding
+ * their code (see insn.h); a function that cannot be decoded all the way
+ * through only gets one at its entry.  The process is seized first, so
+ * the traps come to deet.  When a breakpoint is hit, cover_trap() puts
+ * the original byte back for good, rewinds the instruction pointer and
+ * lets the process go on: each new block costs one stop, and code
+ * already covered runs natively.
+ *
+ * The blocks reached are written as a drcov file, on request or
+ * automatically to $DEET_COVER_DIR/deet-<id>.drcov when the process exits.
+ * Releasing or detaching the process takes out the breakpoints left.  So
+ * none are left behind when deet goes away: quit kills the processes it
+ * started and detaches the others, and the server's shutdown detaches
+ * the covered processes it leaves running.
+ *
+ * Only single-threaded x86-64 processes can be covered.  Clones and forks
+ * are traced for just long enough to keep the breakpoints from killing
+ * the new task: a forked child has them taken out of its copy, and a new
+ * thread ends the coverage, taking them out of the shared memory.
+ */
+
+int cover_start(int deet_id, const char *module, StrBuf *out);
+
+int cover_print(int deet_id, StrBuf *out);
+
+int cover_dump(int deet_id, const char *path);
+
+bool cover_trap(int deet_id, int status);
+
+bool cover_active(int deet_id);
+
+void cover_release(int deet_id, int *sig);
+
+void cover_stray(pid_t pid, int status);
+
+void cover_exit(int deet_id);
+
+#endif
@@ -1,8 +1,41 @@
 #ifndef DEET_RUN_H
 #define DEET_RUN_H
 
+#include <stdbool.h>
+#include "deet.h"
+#include "strbuf.h"
+
 extern int silent_logging;
 
+extern const char *deet_state_path;
+
+/*
+ * Whether deet_command() reports failed calls in its output, for clients
+ * that do not see deet's stderr, rather than with perror().
+ */
+extern bool deet_errors_to_output;
+
+/*
+ * Outcome of deet_command().
+ */
+typedef enum {
+    CMD_OK,	// Command completed
+    CMD_ERROR,	// Command rejected or failed
+    CMD_WAIT,	// Command completes once its WaitTarget is satisfied
+    CMD_QUIT	// The user asked to quit
+} CMD_RESULT;
+
+typedef struct {
+    int deet_id;
+    PSTATE state;
+} WaitTarget;
+
+int deet_command(char *line, StrBuf *out, WaitTarget *wait);
+
+bool wait_satisfied(const WaitTarget *wait);
+
 void run_deet(int silent_logging);
 
-#endif
\ No newline at end of file
+void run_deet_server(const char *path);
+
+#endif
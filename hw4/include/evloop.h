@@ -0,0 +1,19 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+/*
+ * Minimal poll()-based event loop.  Each registered descriptor has one
+ * handler, called with the returned events whenever poll() reports it.
+ */
+
+typedef void (*ev_handler)(int fd, short revents, void *data);
+
+int ev_add(int fd, short events, ev_handler handler, void *data);
+
+int ev_set_events(int fd, short events);
+
+void ev_remove(int fd);
+
+int ev_poll(int timeout_ms);
+
+#endif
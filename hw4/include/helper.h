@@ -1,22 +1,74 @@
 #ifndef HELPER_H
 #define HELPER_H
 
+#include <time.h>
+#include <signal.h>
+#include <stdbool.h>
 #include "deet.h"
+#include "arena.h"
 
-#define MAX_PROCESSES 128
+#define NUM_PSTATES (PSTATE_DEAD + 1)
 
 extern volatile sig_atomic_t sigchld_received;
 
+/*
+ * Process store, kept as parallel arrays indexed by deet ID.
+ * The hot arrays (pid, state, traced) are the only ones touched when
+ * scanning the table; everything else lives in the cold arrays or in
+ * the string arena.  Each state also has a doubly linked membership list
+ * threaded through state_next/state_prev, so queries for one state only
+ * visit the processes in it.  Processes run with the same arguments share
+ * one copy of their strings, found through the interned hash table.
+ */
 typedef struct {
-    pid_t pid; // Process ID
-    int deet_id; // Deet ID
-    char command_line[256]; // Command line
-    PSTATE state; // Process state using PSTATE enum
-    bool traced; // Indicates if the process is being traced
-} ProcessInfo;
+    // Hot fields
+    pid_t *pid; // Process ID
+    PSTATE *state; // Process state using PSTATE enum
+    bool *traced; // Indicates if the process is being traced
+    bool *seized; // Attached with PTRACE_SEIZE
+    int *state_next; // Next process in the same state, or -1
+    int *state_prev; // Previous process in the same state, or -1
 
-extern ProcessInfo process_table[MAX_PROCESSES];
-extern int process_count;
+    // Cold fields
+    int *argc; // Number of arguments
+    size_t *argv; // Arena offset of the NUL-separated argument strings
+    size_t *command_line; // Arena offset of the space-joined command line
+    struct timespec *started; // Time the process was added
+    struct timespec *changed; // Time of the last state change
+    int *group; // Group from run --group, or -1
+    bool *child; // Forked by this deet, rather than attached or restored
+
+    int count;
+    int capacity;
+    int state_head[NUM_PSTATES]; // First process in each state, or -1
+    int state_count[NUM_PSTATES];
+    Arena strings;
+    int *interned; // Open-addressed by hash of the arguments: a deet ID whose strings to share, or -1
+    int interned_size; // Twice the capacity, a power of two
+} ProcessStore;
+
+extern ProcessStore ptable;
+
+// Called on every process state change outside signal context, if set
+extern void (*state_change_hook)(int deet_id, PSTATE old, PSTATE new);
+
+int ptable_add(pid_t pid, int argc, char **argv);
+
+int ptable_find(pid_t pid);
+
+void ptable_set_state(int deet_id, PSTATE new_state);
+
+void ptable_clear(void);
+
+void ptable_kill_all(void);
+
+const char *ptable_command_line(int deet_id);
+
+const char *ptable_arg(int deet_id, int n);
+
+const char *pstate_name(PSTATE state);
+
+int pstate_parse(const char *name);
 
 int get_deet_id(pid_t pid);
 
@@ -26,10 +78,20 @@ void sigint_handler(int sig);
 
 void handle_sigchld();
 
+void handle_wait_status(pid_t pid, int status);
+
 void sigchld_handler(int sig);
 
+void sigchld_arrived(void);
+
+void sigchld_log(int sig);
+
+int sigchld_fd_open(void);
+
+void sigchld_fd_event(int fd, short revents, void *data);
+
 void update_process_state(pid_t pid, PSTATE new_state);
 
 pid_t get_pid(int deet_id);
 
-#endif
\ No newline at end of file
+#endif
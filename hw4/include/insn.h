@@ -0,0 +1,32 @@
+#ifndef INSN_H
+#define INSN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Length decoder for x86-64 machine code, for finding basic blocks.
+ *
+ * It knows the size of every general-purpose, x87, SSE, VEX and EVEX
+ * instruction, and which ones change the flow of control; it does not
+ * know what any of them do.  Anything it is unsure of (XOP, opcodes that
+ * are invalid in 64-bit mode) is refused rather than guessed at.
+ */
+
+typedef enum {
+    INSN_OTHER,	// Goes on to the next instruction, including indirect calls
+    INSN_CALL,	// Direct call, which returns to the next instruction
+    INSN_JCC,	// Conditional direct branch: to its target or the next instruction
+    INSN_JMP,	// Unconditional direct jump
+    INSN_STOP	// Never goes on to the next instruction: ret, indirect jmp, ud2...
+} INSN_KIND;
+
+typedef struct {
+    int len;
+    INSN_KIND kind;
+    int64_t target; // For direct branches, from the start of the instruction
+} Insn;
+
+int insn_decode(const uint8_t *code, size_t avail, Insn *insn);
+
+#endif
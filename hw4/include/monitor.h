@@ -0,0 +1,31 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "strbuf.h"
+
+/*
+ * Memory monitor: samples address ranges of a process at a fixed rate
+ * without stopping it.
+ *
+ * A timerfd in the event loop drives the sampling.  Each tick reads every
+ * range of the process with one process_vm_readv() call.  A range is only
+ * recorded, with its timestamp, when its bytes differ from the previous
+ * sample, into a ring holding the last MONITOR_RING changes.
+ */
+
+#define MONITOR_MAX_RANGES 16
+#define MONITOR_MAX_LEN 64
+#define MONITOR_MAX_HZ 10000
+#define MONITOR_RING 1024
+
+int monitor_add(int deet_id, uintptr_t addr, size_t len, int hz);
+
+int monitor_stop(int deet_id);
+
+int monitor_print(int deet_id, StrBuf *out);
+
+int monitor_export(int deet_id, const char *path);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef SHOW_H
+#define SHOW_H
+
+#include "strbuf.h"
+
+int show_processes(StrBuf *sb, char **args);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef STATEFILE_H
+#define STATEFILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Process table persistence.
+ *
+ * The state file is an array of fixed-size records, one per deet ID,
+ * behind a small header, and is kept mapped for as long as deet runs.
+ * Every table update is a plain store into the mapping, so keeping it
+ * current costs no system calls; the kernel writes it back, and it
+ * survives deet crashing.  start_time (from /proc/<pid>/stat) lets a
+ * restarted deet tell its old processes from reused PIDs.  The file is
+ * locked while mapped, so two deets never share one.
+ */
+
+#define STATEFILE_MAGIC 0x74656564 // "deet"
+#define STATEFILE_VERSION 1
+
+typedef struct {
+    int32_t pid;
+    int32_t deet_id;
+    int32_t state; // PSTATE
+    int32_t traced;
+    uint64_t start_time; // Clock ticks after boot, 0 if unknown
+} StateRecord;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count; // Records in use
+    uint32_t capacity; // Records the file has room for
+    StateRecord records[];
+} StateFile;
+
+int statefile_open(const char *path);
+
+int statefile_count(void);
+
+const StateRecord *statefile_record(int deet_id);
+
+void statefile_sync(int deet_id);
+
+void statefile_close(void);
+
+uint64_t proc_start_time(pid_t pid, char *state);
+
+#endif
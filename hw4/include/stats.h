@@ -0,0 +1,100 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include "strbuf.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Hot-path instrumentation.
+ *
+ * Counters are plain increments; latencies are recorded in raw clock ticks
+ * (TSC where available) into log2 buckets and only converted to nanoseconds
+ * when printed.  Building with -DNO_STATS compiles every hook away.
+ */
+
+typedef enum {
+    CNT_SIGCHLD,	// SIGCHLDs received
+    CNT_STOPPED,	// Children observed stopping
+    CNT_CONTINUED,	// Children observed continuing
+    CNT_EXITED,		// Children observed terminating
+    CNT_SPAWNED,	// Processes started by run
+    CNT_COMMANDS,	// Commands read from the prompt
+    NUM_COUNTERS
+} STAT_COUNTER;
+
+typedef enum {
+    HIST_STATE_UPDATE,	// Child state change to process_table update
+    HIST_PTRACE,	// ptrace() calls
+    HIST_PROCESS_VM,	// process_vm_readv()/process_vm_writev() calls
+    HIST_SIGNAL,	// Signals delivered with kill()
+    HIST_LOG_WRITE,	// Calls into the logging functions
+    NUM_HISTS
+} STAT_HIST;
+
+#define STATS_BUCKETS 48
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum; // Ticks
+    uint64_t max; // Ticks
+    uint64_t buckets[STATS_BUCKETS]; // Bucket b holds values < 2^b ticks, the last any more
+} StatHist;
+
+extern uint64_t stats_counters[NUM_COUNTERS];
+extern StatHist stats_hists[NUM_HISTS];
+
+static inline uint64_t stats_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static inline void stats_record(STAT_HIST id, uint64_t ticks) {
+    StatHist *h = &stats_hists[id];
+    int b = ticks ? 64 - __builtin_clzll(ticks) : 0;
+    if (b >= STATS_BUCKETS) b = STATS_BUCKETS - 1;
+    h->count++;
+    h->sum += ticks;
+    if (ticks > h->max) h->max = ticks;
+    h->buckets[b]++;
+}
+
+#ifndef NO_STATS
+#define STATS_INC(c) (stats_counters[(c)]++)
+#define STATS_TIMED(h, stmt)                                                   \
+  do {                                                                         \
+    uint64_t _stats_t0 = stats_clock();                                        \
+    stmt;                                                                      \
+    stats_record((h), stats_clock() - _stats_t0);                              \
+  } while (0)
+#define STATS_SINCE(h, t0) stats_record((h), stats_clock() - (t0))
+#else
+#define STATS_INC(c)
+#define STATS_TIMED(h, stmt) do { stmt; } while (0)
+#define STATS_SINCE(h, t0)
+#endif
+
+void stats_init(void);
+
+void stats_reset(void);
+
+void stats_print(StrBuf *out);
+
+int stats_write_prometheus(const char *path);
+
+int stats_start_dump(const char *path, int interval_secs);
+
+void stats_stop_dump(void);
+
+void stats_service(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef STRBUF_H
+#define STRBUF_H
+
+#include <stddef.h>
+
+/*
+ * Growable output buffer, used to assemble command output so it can be
+ * handed to the kernel in a single write.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} StrBuf;
+
+int sb_append(StrBuf *sb, const char *data, size_t len);
+
+int sb_printf(StrBuf *sb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+int sb_write(StrBuf *sb, int fd);
+
+void sb_clear(StrBuf *sb);
+
+void sb_free(StrBuf *sb);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * ptrace attachment.
+ *
+ * Processes are attached with PTRACE_SEIZE and stopped with
+ * PTRACE_INTERRUPT, so unlike PTRACE_ATTACH no SIGSTOP is queued that the
+ * target or its real parent could notice.  A seized process reports its
+ * stops to deet through waitpid() just like a child, and handle_sigchld()
+ * passes every signal-delivery stop straight back to it.
+ */
+
+int trace_attach(pid_t pid);
+
+int trace_seize(int deet_id, bool stop);
+
+int trace_cont(int deet_id);
+
+int trace_pause(int deet_id, int *sig);
+
+int trace_resume(int deet_id, int sig);
+
+int trace_release(int deet_id);
+
+void trace_shutdown(void);
+
+bool trace_pass_signal(int deet_id, int status);
+
+int trace_restore(const char *path);
+
+char *proc_cmdline(pid_t pid, int *argc, char ***argv);
+
+#endif
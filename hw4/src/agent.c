@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "agent.h"
+#include "agent_shm.h"
+#include "helper.h"
+#include "stats.h"
+#include "debug.h"
+
+#define AGENT_LIB_ENV "DEET_AGENT_LIB"
+#define AGENT_LIB_NAME "libdeetagent.so"
+#define AGENT_BT_TIMEOUT_NS 20000000 // How long agent <id> bt waits for the handler
+#define AGENT_BT_READ_TRIES 100 // Reads of a backtrace being written before giving up
+
+typedef struct {
+    const AgentShm *shm;
+    ino_t ino; // Of the memfd, to find the region in /proc/<pid>/maps
+} Agent;
+
+static Agent *agents; // Indexed by deet ID
+static int agents_size;
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static char *find_lib(void) {
+    const char *env = getenv(AGENT_LIB_ENV);
+    if (env != NULL) return access(env, R_OK) == 0 ? strdup(env) : NULL;
+
+    char path[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - sizeof(AGENT_LIB_NAME) - 1);
+    if (n <= 0) return NULL;
+    path[n] = 0;
+    char *slash = strrchr(path, '/');
+    if (slash == NULL) return NULL;
+    strcpy(slash + 1, AGENT_LIB_NAME);
+    return access(path, R_OK) == 0 ? strdup(path) : NULL;
+}
+
+/*
+ * Before fork: locate the library and create the shared region.
+ */
+int agent_prepare(AgentLaunch *launch) {
+    launch->fd = -1;
+    if ((launch->lib = find_lib()) == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    if ((launch->fd = memfd_create("deet-agent", MFD_CLOEXEC)) == -1 ||
+        ftruncate(launch->fd, sizeof(AgentShm)) == -1) {
+        agent_abort(launch);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * In the child: let the region survive exec and point the agent at it.
+ */
+void agent_child(AgentLaunch *launch) {
+    char fd[16];
+    fcntl(launch->fd, F_SETFD, 0);
+    snprintf(fd, sizeof(fd), "%d", launch->fd);
+    setenv(AGENT_FD_ENV, fd, 1);
+
+    const char *preload = getenv("LD_PRELOAD");
+    if (preload != NULL && *preload) {
+        char *both = malloc(strlen(launch->lib) + strlen(preload) + 2);
+        if (both != NULL) {
+            sprintf(both, "%s:%s", launch->lib, preload);
+            setenv("LD_PRELOAD", both, 1);
+        }
+    } else {
+        setenv("LD_PRELOAD", launch->lib, 1);
+    }
+}
+
+int agent_start(int deet_id, AgentLaunch *launch) {
+    struct stat st;
+    const AgentShm *shm = MAP_FAILED;
+    if (fstat(launch->fd, &st) == 0) {
+        shm = mmap(NULL, sizeof(AgentShm), PROT_READ, MAP_SHARED, launch->fd, 0);
+    }
+    agent_abort(launch);
+    if (shm == MAP_FAILED) return -1;
+
+    if (deet_id >= agents_size) {
+        int size = agents_size ? agents_size : 16;
+        while (size <= deet_id) size *= 2;
+        Agent *p = realloc(agents, size * sizeof(Agent));
+        if (p == NULL) {
+            munmap((void *)shm, sizeof(AgentShm));
+            return -1;
+        }
+        memset(p + agents_size, 0, (size - agents_size) * sizeof(Agent));
+        agents = p;
+        agents_size = size;
+    }
+    if (agents[deet_id].shm != NULL) munmap((void *)agents[deet_id].shm, sizeof(AgentShm));
+    agents[deet_id] = (Agent){ shm, st.st_ino };
+    return 0;
+}
+
+void agent_abort(AgentLaunch *launch) {
+    if (launch->fd != -1) close(launch->fd);
+    launch->fd = -1;
+    free(launch->lib);
+    launch->lib = NULL;
+}
+
+static const AgentShm *agent_get(int deet_id) {
+    if (deet_id < 0 || deet_id >= agents_size) return NULL;
+    return agents[deet_id].shm;
+}
+
+/*
+ * Whether the agent in deet_id's current image is the one writing the
+ * region: after an exec the region is no longer mapped there, though
+ * what the old image wrote is still in it.
+ */
+static bool agent_mapped(int deet_id) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/maps", (int)ptable.pid[deet_id]);
+    FILE *maps = fopen(path, "r");
+    if (maps == NULL) return false;
+    char *line = NULL;
+    size_t size = 0;
+    bool found = false;
+    while (!found && getline(&line, &size, maps) != -1) {
+        unsigned long long ino;
+        if (sscanf(line, "%*s %*s %*s %*s %llu", &ino) == 1 && ino == agents[deet_id].ino) found = true;
+    }
+    free(line);
+    fclose(maps);
+    return found;
+}
+
+// Whether the process has a handler for sig, according to SigCgt
+static bool catches(pid_t pid, int sig) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return false;
+    char *line = NULL;
+    size_t size = 0;
+    unsigned long long mask = 0;
+    while (getline(&line, &size, f) != -1) {
+        if (sscanf(line, "SigCgt: %llx", &mask) == 1) break;
+    }
+    free(line);
+    fclose(f);
+    return mask & (1ull << (sig - 1));
+}
+
+/*
+ * Append one line per frame, with the module and offset it falls in
+ * according to /proc/<pid>/maps.
+ */
+static void format_frames(pid_t pid, const uint64_t *frames, int n, StrBuf *out) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/maps", (int)pid);
+    FILE *maps = fopen(path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    for (int i = 0; i < n; i++) {
+        const char *module = "?";
+        unsigned long long offset = frames[i];
+        if (maps != NULL) {
+            rewind(maps);
+            while (getline(&line, &size, maps) != -1) {
+                unsigned long long lo, hi, off;
+                int name = 0;
+                if (sscanf(line, "%llx-%llx %*s %llx %*s %*s %n", &lo, &hi, &off, &name) < 3) continue;
+                if (frames[i] < lo || frames[i] >= hi) continue;
+                line[strcspn(line, "\n")] = 0;
+                if (name > 0 && line[name] != 0) {
+                    module = line + name;
+                    offset = frames[i] - lo + off;
+                }
+                break;
+            }
+        }
+        sb_printf(out, "#%-2d 0x%016llx %s+0x%llx\n", i, (unsigned long long)frames[i], module, offset);
+    }
+    free(line);
+    if (maps != NULL) fclose(maps);
+}
+
+/*
+ * Copy the backtrace out under its sequence count.  Returns 1 once it
+ * has a consistent copy, 0 if there is no backtrace, and -1 if it is
+ * still being written after a few tries: a process that stops, or dies,
+ * inside the handler leaves it that way for good.
+ */
+static int read_backtrace(const AgentShm *shm, uint64_t *frames, int *depth, uint64_t *ns, int *tid) {
+    struct timespec pause = { 0, 10000 };
+    for (int i = 0; i < AGENT_BT_READ_TRIES; i++) {
+        uint32_t seq = __atomic_load_n(&shm->bt_seq, __ATOMIC_ACQUIRE);
+        if (seq == 0) return 0;
+        if (!(seq & 1)) {
+            *depth = shm->bt_depth < AGENT_BT_DEPTH ? shm->bt_depth : AGENT_BT_DEPTH;
+            memcpy(frames, (const void *)shm->bt, *depth * sizeof(uint64_t));
+            *ns = shm->bt_ns;
+            *tid = shm->bt_tid;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&shm->bt_seq, __ATOMIC_RELAXED) == seq) return 1;
+        }
+        nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+static void print_backtrace(const AgentShm *shm, pid_t pid, StrBuf *out) {
+    uint64_t frames[AGENT_BT_DEPTH], ns;
+    int depth, tid;
+    int rc = read_backtrace(shm, frames, &depth, &ns, &tid);
+    if (rc == 0) return;
+    if (rc == -1) {
+        sb_printf(out, "Backtrace busy: the process is still writing it\n");
+        return;
+    }
+    sb_printf(out, "backtrace of thread %d, %llu ms ago:\n", tid,
+              (unsigned long long)((mono_ns() - ns) / 1000000));
+    format_frames(pid, frames, depth, out);
+}
+
+/*
+ * Print what the agent of deet_id has published, using only loads from
+ * the shared region (and /proc to place backtrace frames).  Returns -1
+ * if the process was not started with an agent.
+ */
+int agent_print(int deet_id, StrBuf *out) {
+    const AgentShm *shm = agent_get(deet_id);
+    if (shm == NULL) return -1;
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != AGENT_MAGIC) {
+        sb_printf(out, "Agent not loaded yet\n");
+        return 0;
+    }
+    if (ptable.state[deet_id] != PSTATE_DEAD && !agent_mapped(deet_id)) {
+        sb_printf(out, "Agent gone: the process has exec'd\n");
+        return 0;
+    }
+    uint64_t beats = __atomic_load_n(&shm->heartbeats, __ATOMIC_ACQUIRE);
+    uint64_t last = __atomic_load_n(&shm->heartbeat_ns, __ATOMIC_RELAXED);
+    uint64_t mallocs = shm->mallocs, callocs = shm->callocs, frees = shm->frees;
+    if (beats == 0) {
+        // The thread has not ticked yet: there is no time to go by
+        sb_printf(out, "pid %d, no heartbeat yet (every %u ms)\n", (int)ptable.pid[deet_id],
+                  shm->heartbeat_ms);
+    } else {
+        sb_printf(out, "pid %d, heartbeat %llu (%llu ms ago, every %u ms)\n", (int)ptable.pid[deet_id],
+                  (unsigned long long)beats, (unsigned long long)((mono_ns() - last) / 1000000),
+                  shm->heartbeat_ms);
+    }
+    sb_printf(out, "malloc %llu\tcalloc %llu\trealloc %llu\tfree %llu\tlive %lld\tbytes %llu\n",
+              (unsigned long long)mallocs, (unsigned long long)callocs,
+              (unsigned long long)shm->reallocs, (unsigned long long)frees,
+              (long long)(mallocs + callocs - frees), (unsigned long long)shm->bytes_requested);
+    print_backtrace(shm, ptable.pid[deet_id], out);
+    return 0;
+}
+
+/*
+ * Ask the agent for a fresh backtrace and print it.  The request is a
+ * signal, handled whenever the process next runs; if that takes longer
+ * than a moment, the backtrace shows up in a later agent <id>.
+ */
+int agent_backtrace(int deet_id, StrBuf *out) {
+    const AgentShm *shm = agent_get(deet_id);
+    if (shm == NULL) return -1;
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != AGENT_MAGIC) {
+        sb_printf(out, "Agent not loaded yet\n");
+        return 0;
+    }
+    // Without the agent's handler, the signal would kill the process
+    pid_t pid = ptable.pid[deet_id];
+    if (!agent_mapped(deet_id)) {
+        sb_printf(out, "Agent gone: the process has exec'd\n");
+        return 0;
+    }
+    if (!catches(pid, AGENT_BT_SIGNAL)) {
+        sb_printf(out, "Agent has no backtrace handler\n");
+        return 0;
+    }
+    uint32_t before = __atomic_load_n(&shm->bt_seq, __ATOMIC_ACQUIRE);
+    int rc;
+    STATS_TIMED(HIST_SIGNAL, rc = kill(pid, AGENT_BT_SIGNAL));
+    if (rc == -1) return -1;
+
+    uint64_t deadline = mono_ns() + AGENT_BT_TIMEOUT_NS;
+    struct timespec pause = { 0, 50000 };
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&shm->bt_seq, __ATOMIC_ACQUIRE);
+        if (seq != before && !(seq & 1)) break;
+        if (mono_ns() > deadline) {
+            sb_printf(out, "Backtrace requested\n");
+            return 0;
+        }
+        nanosleep(&pause, NULL);
+    }
+    print_backtrace(shm, pid, out);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#include <string.h>
+#include <stdlib.h>
+#include "arena.h"
+
+#define ARENA_INITIAL_SIZE 4096
+
+size_t arena_append(Arena *arena, const void *data, size_t len) {
+    if (arena->used + len > arena->capacity) {
+        size_t capacity = arena->capacity ? arena->capacity : ARENA_INITIAL_SIZE;
+        while (arena->used + len > capacity) capacity *= 2;
+        char *base = realloc(arena->base, capacity);
+        if (base == NULL) return ARENA_NONE;
+        arena->base = base;
+        arena->capacity = capacity;
+    }
+    size_t offset = arena->used;
+    memcpy(arena->base + offset, data, len);
+    arena->used += len;
+    return offset;
+}
+
+size_t arena_append_str(Arena *arena, const char *str) {
+    return arena_append(arena, str, strlen(str) + 1);
+}
@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+#include "capture.h"
+#include "evloop.h"
+#include "debug.h"
+
+#define CAPTURE_DIR_ENV "DEET_CAPTURE_DIR"
+
+typedef struct {
+    int deet_id;
+    int src[2]; // Read ends of the stdout/stderr pipes, -1 once closed
+    size_t teed[2]; // Bytes at the head of each source already in the ring
+    int ring[2]; // Pipe holding the most recent output, -1 once freed
+    StrBuf saved; // What the ring held when it was freed
+    int log_fd; // -1 once both sources are closed
+    loff_t log_off;
+    bool exited;
+} Capture;
+
+static Capture **captures; // Indexed by deet ID
+static int captures_size;
+static int devnull_fd = -1;
+
+static void close_pair(int fds[2]) {
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] != -1) close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+int capture_prepare(CapturePipes *pipes) {
+    pipes->out[0] = pipes->out[1] = pipes->err[0] = pipes->err[1] = -1;
+    if (pipe2(pipes->out, O_CLOEXEC) == -1 || pipe2(pipes->err, O_CLOEXEC) == -1) {
+        capture_abort(pipes);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * In the child: make the write ends stdout and stderr.  dup2() clears
+ * close-on-exec on the new descriptors; everything else is closed by exec.
+ */
+void capture_child(CapturePipes *pipes) {
+    dup2(pipes->out[1], STDOUT_FILENO);
+    dup2(pipes->err[1], STDERR_FILENO);
+}
+
+void capture_abort(CapturePipes *pipes) {
+    close_pair(pipes->out);
+    close_pair(pipes->err);
+}
+
+/*
+ * Drop the oldest bytes from the ring so that at least want bytes (or
+ * one more pipe buffer) fit again.  splice() to /dev/null discards them
+ * without copying.
+ */
+static void ring_drop(Capture *c, size_t want) {
+    int queued = 0;
+    if (ioctl(c->ring[0], FIONREAD, &queued) == -1 || queued == 0) return;
+    size_t drop = want < (size_t)queued ? want : (size_t)queued;
+    if (drop < 4096 && (size_t)queued > drop) drop = 4096;
+    splice(c->ring[0], NULL, devnull_fd, NULL, drop, SPLICE_F_NONBLOCK);
+}
+
+/*
+ * Keep the last output of a finished capture in memory and give back
+ * the ring's descriptors.  Nothing more can arrive once every writer has
+ * closed its end and the process is gone.
+ */
+static void ring_free(Capture *c) {
+    if (c->ring[0] == -1) return;
+    char buf[4096];
+    ssize_t r;
+    while ((r = read(c->ring[0], buf, sizeof(buf))) > 0) sb_append(&c->saved, buf, r);
+    close_pair(c->ring);
+}
+
+static void capture_close_src(Capture *c, int i) {
+    ev_remove(c->src[i]);
+    close(c->src[i]);
+    c->src[i] = -1;
+    c->teed[i] = 0;
+    if (c->src[1 - i] != -1) return;
+    close(c->log_fd);
+    c->log_fd = -1;
+    if (c->exited) ring_free(c);
+}
+
+static void capture_free(Capture *c) {
+    for (int i = 0; i < 2; i++) {
+        if (c->src[i] != -1) {
+            ev_remove(c->src[i]);
+            close(c->src[i]);
+        }
+    }
+    if (c->log_fd != -1) close(c->log_fd);
+    close_pair(c->ring);
+    sb_free(&c->saved);
+    free(c);
+}
+
+/*
+ * Move what is readable on fd into the ring and the log.  Bytes are
+ * tee()d once: if the log takes only part of them, the rest is counted
+ * in teed and goes to the log next time without being tee()d again.
+ */
+static void capture_event(int fd, short revents, void *data) {
+    Capture *c = data;
+    int i = c->src[0] == fd ? 0 : 1;
+    size_t moved = 0;
+    while (moved < CAPTURE_BUDGET) {
+        ssize_t n = c->teed[i];
+        if (n == 0) {
+            n = tee(fd, c->ring[1], CAPTURE_BUDGET - moved, SPLICE_F_NONBLOCK);
+            if (n == -1 && errno == EAGAIN) {
+                // Either the source is empty or the ring is full
+                struct pollfd p = { .fd = fd, .events = POLLIN };
+                if (poll(&p, 1, 0) <= 0 || !(p.revents & POLLIN)) break;
+                ring_drop(c, CAPTURE_RING_SIZE / 4);
+                n = tee(fd, c->ring[1], CAPTURE_BUDGET - moved, SPLICE_F_NONBLOCK);
+                if (n == -1) {
+                    // Ring still full: log what is queued without keeping it
+                    int queued = 0;
+                    if (ioctl(fd, FIONREAD, &queued) == -1 || queued <= 0) break;
+                    n = (size_t)queued < CAPTURE_BUDGET - moved ? queued : CAPTURE_BUDGET - moved;
+                }
+            }
+            if (n == 0) {
+                // Writer closed: nothing left in the pipe
+                capture_close_src(c, i);
+                return;
+            }
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                capture_close_src(c, i);
+                return;
+            }
+            c->teed[i] = n;
+        }
+        ssize_t m = splice(fd, NULL, c->log_fd, &c->log_off, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (m <= 0) {
+            if (m == -1 && errno == EAGAIN) break;
+            // Log file unusable: keep draining into /dev/null
+            m = splice(fd, NULL, devnull_fd, NULL, n, SPLICE_F_NONBLOCK);
+            if (m <= 0) break;
+        }
+        c->teed[i] -= m;
+        moved += m;
+    }
+    if ((revents & (POLLHUP | POLLERR)) && !(revents & POLLIN)) {
+        capture_close_src(c, i);
+    }
+}
+
+static int open_log(int deet_id) {
+    const char *dir = getenv(CAPTURE_DIR_ENV);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/deet-%d.log", dir != NULL ? dir : ".", deet_id);
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/*
+ * In the parent, after fork: take over the read ends of pipes and start
+ * moving their data for deet_id.  The write ends are closed here.
+ */
+int capture_start(int deet_id, CapturePipes *pipes) {
+    close(pipes->out[1]);
+    close(pipes->err[1]);
+    pipes->out[1] = pipes->err[1] = -1;
+
+    if (devnull_fd == -1 && (devnull_fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) == -1) goto fail;
+    if (deet_id >= captures_size) {
+        int size = captures_size ? captures_size : 16;
+        while (size <= deet_id) size *= 2;
+        Capture **p = realloc(captures, size * sizeof(Capture *));
+        if (p == NULL) goto fail;
+        memset(p + captures_size, 0, (size - captures_size) * sizeof(Capture *));
+        captures = p;
+        captures_size = size;
+    }
+
+    if (captures[deet_id] != NULL) {
+        // The deet ID is being reused
+        capture_free(captures[deet_id]);
+        captures[deet_id] = NULL;
+    }
+    Capture *c = calloc(1, sizeof(Capture));
+    if (c == NULL) goto fail;
+    c->deet_id = deet_id;
+    c->ring[0] = c->ring[1] = -1;
+    if ((c->log_fd = open_log(deet_id)) == -1 ||
+        pipe2(c->ring, O_CLOEXEC | O_NONBLOCK) == -1) {
+        if (c->log_fd != -1) close(c->log_fd);
+        close_pair(c->ring);
+        free(c);
+        goto fail;
+    }
+    fcntl(c->ring[1], F_SETPIPE_SZ, CAPTURE_RING_SIZE);
+
+    c->src[0] = pipes->out[0];
+    c->src[1] = pipes->err[0];
+    for (int i = 0; i < 2; i++) {
+        fcntl(c->src[i], F_SETFL, fcntl(c->src[i], F_GETFL) | O_NONBLOCK);
+        ev_add(c->src[i], POLLIN, capture_event, c);
+    }
+    captures[deet_id] = c;
+    return 0;
+
+fail:
+    capture_abort(pipes);
+    return -1;
+}
+
+// Append the last tail_lines lines of buf to out, or all of it if tail_lines <= 0
+static void tail(const StrBuf *buf, int tail_lines, StrBuf *out) {
+    size_t start = 0;
+    if (tail_lines > 0 && buf->len > 0) {
+        size_t i = buf->len;
+        if (buf->data[i - 1] == '\n') i--;
+        while (i > 0) {
+            if (buf->data[i - 1] == '\n' && --tail_lines == 0) break;
+            i--;
+        }
+        start = i;
+    }
+    sb_append(out, buf->data + start, buf->len - start);
+}
+
+/*
+ * deet_id has terminated.  Its output may still be in flight, or held by
+ * a descendant, so the ring goes once both sources have closed too.
+ */
+void capture_exit(int deet_id) {
+    if (deet_id < 0 || deet_id >= captures_size || captures[deet_id] == NULL) return;
+    Capture *c = captures[deet_id];
+    c->exited = true;
+    if (c->src[0] == -1 && c->src[1] == -1) ring_free(c);
+}
+
+/*
+ * Append the ring contents for deet_id to out, limited to the last
+ * tail_lines lines if tail_lines > 0.  Output already written but not
+ * yet moved by the event loop is taken in first, and the ring is
+ * duplicated with tee() so reading it does not consume it.  Returns -1
+ * if the process has no capture.
+ */
+int capture_output(int deet_id, int tail_lines, StrBuf *out) {
+    if (deet_id < 0 || deet_id >= captures_size || captures[deet_id] == NULL) return -1;
+    Capture *c = captures[deet_id];
+    for (int i = 0; i < 2; i++) {
+        if (c->src[i] != -1) capture_event(c->src[i], POLLIN, c);
+    }
+    if (c->ring[0] == -1) {
+        tail(&c->saved, tail_lines, out);
+        return 0;
+    }
+
+    int copy[2];
+    if (pipe2(copy, O_CLOEXEC | O_NONBLOCK) == -1) return -1;
+    fcntl(copy[1], F_SETPIPE_SZ, CAPTURE_RING_SIZE);
+
+    // The copy pipe is as large as the ring, so one tee() takes all of it
+    StrBuf snap = {0};
+    if (tee(c->ring[0], copy[1], INT_MAX, SPLICE_F_NONBLOCK) > 0) {
+        char buf[4096];
+        ssize_t r;
+        while ((r = read(copy[0], buf, sizeof(buf))) > 0) sb_append(&snap, buf, r);
+    }
+    close_pair(copy);
+
+    tail(&snap, tail_lines, out);
+    sb_free(&snap);
+    return 0;
+}
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "cgroup.h"
+#include "helper.h"
+#include "evloop.h"
+#include "stats.h"
+#include "debug.h"
+#include "deet.h"
+
+typedef struct {
+    char *name;
+    int dir_fd; // cgroup directory, -1 when using signals
+    int events_fd; // cgroup.events, watched for changes of "frozen"
+    bool frozen; // Last requested state
+} Group;
+
+static Group *groups;
+static int num_groups;
+
+static char *base_path; // deet-<pid> directory
+static int base_state; // 0 not yet tried, 1 usable, -1 unavailable
+
+static int write_at(int dir_fd, const char *file, const char *s) {
+    int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = write(fd, s, strlen(s));
+    close(fd);
+    return n == (ssize_t)strlen(s) ? 0 : -1;
+}
+
+static ssize_t read_at(int dir_fd, const char *file, char *buf, size_t size) {
+    int fd = openat(dir_fd, file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = 0;
+    return n;
+}
+
+// Value of "key <n>" in a flat-keyed cgroup file, or -1
+static long long keyed_value(const char *buf, const char *key) {
+    size_t len = strlen(key);
+    for (const char *p = buf; p != NULL; p = strchr(p, '\n')) {
+        if (*p == '\n') p++;
+        if (strncmp(p, key, len) == 0 && p[len] == ' ') return atoll(p + len + 1);
+    }
+    return -1;
+}
+
+static void enable_controller(int dir_fd, const char *controllers, const char *name) {
+    char request[16];
+    snprintf(request, sizeof(request), "+%s", name);
+    if (strstr(controllers, name) == NULL) {
+        fprintf(stderr, "cgroup.subtree_control %s: controller not available\n", request);
+    } else if (write_at(dir_fd, "cgroup.subtree_control", request) == -1) {
+        fprintf(stderr, "cgroup.subtree_control %s: %s\n", request, strerror(errno));
+    }
+}
+
+/*
+ * Find where the cgroup v2 hierarchy is mounted and create deet's
+ * subtree under the cgroup deet itself runs in.
+ */
+static int base_init(void) {
+    char *line = NULL, *mount = NULL, *self = NULL;
+    size_t size = 0;
+
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    if (f == NULL) return -1;
+    while (mount == NULL && getline(&line, &size, f) != -1) {
+        // <id> <parent> <dev> <root> <mount point> <options>... - <fstype> ...
+        char *sep = strstr(line, " - ");
+        if (sep == NULL || strncmp(sep + 3, "cgroup2 ", 8) != 0) continue;
+        char *save, *field = strtok_r(line, " ", &save);
+        for (int i = 0; i < 4 && field != NULL; i++) field = strtok_r(NULL, " ", &save);
+        if (field != NULL) mount = strdup(field);
+    }
+    fclose(f);
+
+    if ((f = fopen("/proc/self/cgroup", "r")) != NULL) {
+        while (self == NULL && getline(&line, &size, f) != -1) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = 0;
+                self = strdup(line + 3);
+            }
+        }
+        fclose(f);
+    }
+    free(line);
+
+    int ret = -1;
+    char path[PATH_MAX];
+    if (mount != NULL && self != NULL &&
+        snprintf(path, sizeof(path), "%s%s/deet-%d", mount,
+                 strcmp(self, "/") == 0 ? "" : self, (int)getpid()) < (int)sizeof(path) &&
+        (mkdir(path, 0755) == 0 || errno == EEXIST)) {
+        base_path = strdup(path);
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (base_path != NULL && fd != -1) {
+            // Groups work without them, but show no cpu or memory usage
+            char controllers[256];
+            if (read_at(fd, "cgroup.controllers", controllers, sizeof(controllers)) == -1) {
+                perror("cgroup.controllers");
+            } else {
+                enable_controller(fd, controllers, "cpu");
+                enable_controller(fd, controllers, "memory");
+            }
+            ret = 0;
+        }
+        if (fd != -1) close(fd);
+    }
+    free(mount);
+    free(self);
+    return ret;
+}
+
+static bool valid_name(const char *name) {
+    if (*name == 0 || strlen(name) > 64) return false;
+    for (const char *p = name; *p; p++) {
+        if (!isalnum((unsigned char)*p) && *p != '_' && *p != '-') return false;
+    }
+    return true;
+}
+
+static int group_find(const char *name) {
+    for (int g = 0; g < num_groups; g++) {
+        if (strcmp(groups[g].name, name) == 0) return g;
+    }
+    return -1;
+}
+
+/*
+ * Move every live member of g that is in state from to state to.
+ */
+static void members_set_state(int g, PSTATE from, PSTATE to) {
+    for (int id = ptable.state_head[from], next; id != -1; id = next) {
+        next = ptable.state_next[id];
+        if (ptable.group[id] != g) continue;
+        ptable_set_state(id, to);
+        log_state_change(ptable.pid[id], from, to, 0);
+    }
+}
+
+/*
+ * cgroup.events changed, or a freeze was just requested: settle the
+ * members' states once the kernel reports the group (un)frozen.
+ */
+static void group_events(int fd, short revents, void *data) {
+    int g = (int)(long)data;
+    char buf[256];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return;
+    buf[n] = 0;
+    long long frozen = keyed_value(buf, "frozen");
+    if (frozen == 1 && groups[g].frozen) {
+        members_set_state(g, PSTATE_STOPPING, PSTATE_STOPPED);
+    } else if (frozen == 0 && !groups[g].frozen) {
+        members_set_state(g, PSTATE_CONTINUING, PSTATE_RUNNING);
+    }
+}
+
+static int group_create(const char *name) {
+    if (!valid_name(name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    Group *p = realloc(groups, (num_groups + 1) * sizeof(Group));
+    if (p == NULL) return -1;
+    groups = p;
+    Group *g = &groups[num_groups];
+    if ((g->name = strdup(name)) == NULL) return -1;
+    g->dir_fd = g->events_fd = -1;
+    g->frozen = false;
+
+    if (base_state == 0) base_state = base_init() == 0 ? 1 : -1;
+    if (base_state == 1) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", base_path, name);
+        if ((mkdir(path, 0755) == 0 || errno == EEXIST) &&
+            (g->dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1 &&
+            (g->events_fd = openat(g->dir_fd, "cgroup.events", O_RDONLY | O_CLOEXEC)) != -1 &&
+            ev_add(g->events_fd, POLLPRI, group_events, (void *)(long)num_groups) == 0) {
+            write_at(g->dir_fd, "cgroup.freeze", "0");
+        } else {
+            warn("Cannot use cgroup %s, falling back to signals", path);
+            if (g->events_fd != -1) close(g->events_fd);
+            if (g->dir_fd != -1) close(g->dir_fd);
+            g->dir_fd = g->events_fd = -1;
+        }
+    }
+    return num_groups++;
+}
+
+/*
+ * Before fork: find or create the group, and open what the child needs
+ * to join it.  The group is left as it is: members already running are
+ * not stopped to launch a new one.
+ */
+int group_prepare(const char *name, GroupLaunch *launch) {
+    launch->procs_fd = -1;
+    launch->group = group_find(name);
+    if (launch->group == -1 && (launch->group = group_create(name)) == -1) return -1;
+    Group *g = &groups[launch->group];
+    if (g->dir_fd == -1) return 0;
+
+    if ((launch->procs_fd = openat(g->dir_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC)) == -1) return -1;
+    return 0;
+}
+
+/*
+ * In the child: join the group's cgroup, "0" naming the writing process.
+ * A frozen cgroup stops the child as it joins; in a thawed one run stops
+ * it with a signal, as it does any other process.  A child that cannot
+ * join exits rather than run outside its group.
+ */
+void group_child(GroupLaunch *launch) {
+    if (launch->procs_fd == -1) return;
+    if (write(launch->procs_fd, "0", 1) != 1) {
+        perror("cgroup.procs");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void group_start(int deet_id, GroupLaunch *launch) {
+    ptable.group[deet_id] = launch->group;
+    group_abort(launch);
+}
+
+void group_abort(GroupLaunch *launch) {
+    if (launch->procs_fd != -1) close(launch->procs_fd);
+    launch->procs_fd = -1;
+}
+
+/*
+ * Whether deet_id is held by its group's cgroup freezer, so signals
+ * alone cannot continue it.
+ */
+bool group_frozen(int deet_id) {
+    int g = ptable.group[deet_id];
+    return g != -1 && groups[g].dir_fd != -1 && groups[g].frozen;
+}
+
+/*
+ * Freeze or thaw a whole group.  With a cgroup this is one write, and
+ * members go through stopping/continuing until cgroup.events confirms
+ * it.  Otherwise each live member is signalled.
+ */
+int group_freeze(const char *name, bool freeze) {
+    int g = group_find(name);
+    if (g == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+    Group *grp = &groups[g];
+    if (grp->dir_fd != -1) {
+        int rc;
+        STATS_TIMED(HIST_SIGNAL, rc = write_at(grp->dir_fd, "cgroup.freeze", freeze ? "1" : "0"));
+        if (rc == -1) return -1;
+        grp->frozen = freeze;
+        if (freeze) {
+            members_set_state(g, PSTATE_RUNNING, PSTATE_STOPPING);
+        } else {
+            // The freezer only lets go of what it holds: members stopped by
+            // a signal, as one launched into a thawed group is, need SIGCONT
+            for (int id = ptable.state_head[PSTATE_STOPPED]; id != -1; id = ptable.state_next[id]) {
+                if (ptable.group[id] == g) STATS_TIMED(HIST_SIGNAL, kill(ptable.pid[id], SIGCONT));
+            }
+            members_set_state(g, PSTATE_STOPPED, PSTATE_CONTINUING);
+            members_set_state(g, PSTATE_STOPPING, PSTATE_CONTINUING);
+        }
+        group_events(grp->events_fd, POLLPRI, (void *)(long)g);
+        return 0;
+    }
+
+    grp->frozen = freeze;
+    PSTATE from = freeze ? PSTATE_RUNNING : PSTATE_STOPPED;
+    PSTATE to = freeze ? PSTATE_STOPPED : PSTATE_RUNNING;
+    for (int id = ptable.state_head[from], next; id != -1; id = next) {
+        next = ptable.state_next[id];
+        if (ptable.group[id] != g) continue;
+        STATS_TIMED(HIST_SIGNAL, kill(ptable.pid[id], freeze ? SIGSTOP : SIGCONT));
+        ptable_set_state(id, to);
+        log_state_change(ptable.pid[id], from, to, 0);
+    }
+    return 0;
+}
+
+/*
+ * One line per group: live members, state, and the cgroup's CPU time and
+ * memory use ("-" where not available).
+ */
+void group_list(StrBuf *out) {
+    if (num_groups == 0) {
+        sb_printf(out, "No groups.\n");
+        return;
+    }
+    sb_printf(out, "group\t\tmembers\tstate\tcpu_usec\tmemory\n");
+    for (int g = 0; g < num_groups; g++) {
+        Group *grp = &groups[g];
+        int members = 0;
+        for (int id = 0; id < ptable.count; id++) {
+            if (ptable.group[id] == g && ptable.state[id] != PSTATE_DEAD) members++;
+        }
+        const char *state = grp->frozen ? "frozen" : "thawed";
+        long long cpu = -1, mem = -1;
+        char buf[1024];
+        if (grp->dir_fd != -1) {
+            if (read_at(grp->dir_fd, "cgroup.events", buf, sizeof(buf)) > 0 &&
+                keyed_value(buf, "frozen") != grp->frozen) {
+                state = grp->frozen ? "freezing" : "thawing";
+            }
+            if (read_at(grp->dir_fd, "cpu.stat", buf, sizeof(buf)) > 0) cpu = keyed_value(buf, "usage_usec");
+            if (read_at(grp->dir_fd, "memory.current", buf, sizeof(buf)) > 0) mem = atoll(buf);
+        }
+        sb_printf(out, "%-12s\t%d\t%s\t", grp->name, members, state);
+        if (cpu >= 0) sb_printf(out, "%lld\t", cpu);
+        else sb_printf(out, "-\t");
+        if (mem >= 0) sb_printf(out, "%lld\n", mem);
+        else sb_printf(out, "-\n");
+    }
+}
+
+/*
+ * Remove the cgroups that no longer hold processes.  Frozen groups with
+ * live members are left as they are, like processes stopped by signals.
+ */
+void group_cleanup(void) {
+    for (int g = 0; g < num_groups; g++) {
+        Group *grp = &groups[g];
+        if (grp->events_fd != -1) {
+            ev_remove(grp->events_fd);
+            close(grp->events_fd);
+        }
+        if (grp->dir_fd != -1) close(grp->dir_fd);
+        if (base_path != NULL) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", base_path, grp->name);
+            rmdir(path);
+        }
+        free(grp->name);
+    }
+    free(groups);
+    groups = NULL;
+    num_groups = 0;
+    if (base_path != NULL) rmdir(base_path);
+    free(base_path);
+    base_path = NULL;
+    base_state = 0;
+}
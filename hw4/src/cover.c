@@ -0,0 +1,619 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include "cover.h"
+#include "insn.h"
+#include "trace.h"
+#include "helper.h"
+#include "statefile.h"
+#include "stats.h"
+#include "debug.h"
+
+#define COVER_DIR_ENV "DEET_COVER_DIR"
+#define INT3 0xcc
+#define COVER_OPTIONS (PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK)
+#define MAX_STRAYS 16
+
+typedef struct {
+    uint64_t addr;
+    uint16_t size; // Of the basic block it starts
+    uint8_t orig; // Byte the int3 replaced
+    bool hit;
+} Breakpoint;
+
+typedef struct {
+    int deet_id;
+    int mem_fd; // /proc/<pid>/mem, for writing past page protections
+    char *module; // As named by the user, NULL for the main executable
+    char *path; // Module file
+    uint64_t base, end; // Where it is mapped
+    Breakpoint *bps; // Sorted by address
+    int nbps;
+    int bps_size;
+    int *hits; // Indexes into bps, in the order they were hit
+    int nhits;
+} Cover;
+
+static Cover **covers; // Indexed by deet ID
+static int covers_size;
+
+// New tasks whose first stop was reported before their parent's event
+static pid_t strays[MAX_STRAYS];
+static int nstrays;
+
+typedef struct {
+    uint64_t lo, hi;
+} Range;
+
+static Cover *cover_get(int deet_id) {
+    if (deet_id < 0 || deet_id >= covers_size) return NULL;
+    return covers[deet_id];
+}
+
+// Forget the module, as before cover_load()
+static void cover_unload(Cover *c) {
+    if (c->mem_fd != -1) close(c->mem_fd);
+    c->mem_fd = -1;
+    free(c->path);
+    free(c->bps);
+    free(c->hits);
+    c->path = NULL;
+    c->bps = NULL;
+    c->hits = NULL;
+    c->nbps = c->nhits = c->bps_size = 0;
+    c->base = c->end = 0;
+}
+
+static void cover_free(Cover *c) {
+    cover_unload(c);
+    free(c->module);
+    free(c);
+}
+
+static int thread_count(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    char *line = NULL;
+    size_t size = 0;
+    int n = -1;
+    while (getline(&line, &size, f) != -1) {
+        if (sscanf(line, "Threads: %d", &n) == 1) break;
+    }
+    free(line);
+    fclose(f);
+    return n;
+}
+
+// Whether the mapped file at path is the module the user named
+static bool module_matches(const char *path, const char *module) {
+    if (strcmp(path, module) == 0) return true;
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    size_t len = strlen(module);
+    return strncmp(base, module, len) == 0 && (base[len] == 0 || base[len] == '.' || base[len] == '-');
+}
+
+/*
+ * Find the module in /proc/<pid>/maps: the main executable if module is
+ * NULL.  Fills in its path and extent, and its executable ranges.
+ */
+static int find_module(pid_t pid, const char *module, Cover *c, Range *exec, int *nexec, int max) {
+    char path[64], exe[PATH_MAX];
+    exe[0] = 0;
+    if (module == NULL) {
+        snprintf(path, sizeof(path), "/proc/%d/exe", (int)pid);
+        ssize_t n = readlink(path, exe, sizeof(exe) - 1);
+        if (n <= 0) return -1;
+        exe[n] = 0;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/maps", (int)pid);
+    FILE *maps = fopen(path, "r");
+    if (maps == NULL) return -1;
+
+    char *line = NULL;
+    size_t size = 0;
+    *nexec = 0;
+    while (getline(&line, &size, maps) != -1) {
+        unsigned long long lo, hi, off;
+        char perms[8];
+        int name = 0;
+        if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &lo, &hi, perms, &off, &name) < 4) continue;
+        if (name == 0 || line[name] != '/') continue;
+        line[strcspn(line, "\n")] = 0;
+        const char *file = line + name;
+        if (c->path == NULL) {
+            if (!(module == NULL ? strcmp(file, exe) == 0 : module_matches(file, module))) continue;
+            if (off != 0) continue;
+            if ((c->path = strdup(file)) == NULL) break;
+            c->base = lo;
+        } else if (strcmp(file, c->path) != 0) {
+            continue;
+        }
+        if (hi > c->end) c->end = hi;
+        if (perms[2] == 'x' && *nexec < max) exec[(*nexec)++] = (Range){ lo, hi };
+    }
+    free(line);
+    fclose(maps);
+    if (c->path == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+static int cmp_addr(const void *a, const void *b) {
+    uint64_t x = ((const Breakpoint *)a)->addr, y = ((const Breakpoint *)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+static bool read_at(int fd, void *buf, size_t len, off_t off) {
+    return pread(fd, buf, len, off) == (ssize_t)len;
+}
+
+static int add_block(Cover *c, uint64_t addr, size_t size, const Range *exec, int nexec) {
+    int r = 0;
+    while (r < nexec && !(addr >= exec[r].lo && addr < exec[r].hi)) r++;
+    if (r == nexec) return 0;
+    if (c->nbps == c->bps_size) {
+        int n = c->bps_size ? c->bps_size * 2 : 256;
+        Breakpoint *p = realloc(c->bps, n * sizeof(Breakpoint));
+        if (p == NULL) return -1;
+        c->bps = p;
+        c->bps_size = n;
+    }
+    c->bps[c->nbps++] = (Breakpoint){ .addr = addr, .size = size > UINT16_MAX ? UINT16_MAX : size };
+    return 0;
+}
+
+#define BLOCK_LEADER 0x80 // In lens[]: a basic block starts at this instruction
+#define BLOCK_ENDS 0x40 // The block ends after this instruction
+#define BLOCK_LEN 0x0f
+
+/*
+ * Split the function at addr, whose size bytes of code are given, into
+ * basic blocks.  One starts at the entry, at the target of every direct
+ * jump and after every conditional branch; calls are taken to return.
+ * The code is decoded in a single sweep, which has to account for every
+ * byte of the function.  If it does not (data in the code, or something
+ * the decoder refuses), only the entry is used: an int3 that is not at
+ * the start of an instruction would corrupt it.  For the same reason a
+ * target is only used if the sweep found an instruction there.
+ */
+static int add_function(Cover *c, uint64_t addr, const uint8_t *code, size_t size,
+                        const Range *exec, int nexec) {
+    uint8_t *lens = calloc(size, 1);
+    if (lens == NULL) return -1;
+    size_t i = 0;
+    Insn insn;
+    while (i < size) {
+        int len = insn_decode(code + i, size - i, &insn);
+        if (len == -1) break;
+        lens[i] = len;
+        if (insn.kind == INSN_JCC || insn.kind == INSN_JMP || insn.kind == INSN_STOP) lens[i] |= BLOCK_ENDS;
+        i += len;
+    }
+    if (i != size) {
+        free(lens);
+        return add_block(c, addr, 1, exec, nexec);
+    }
+
+    lens[0] |= BLOCK_LEADER;
+    for (i = 0; i < size; i += lens[i] & BLOCK_LEN) {
+        insn_decode(code + i, size - i, &insn);
+        int64_t target = (int64_t)i + insn.target;
+        if ((insn.kind == INSN_JCC || insn.kind == INSN_JMP) && target >= 0 && (size_t)target < size &&
+            lens[target] != 0) {
+            lens[target] |= BLOCK_LEADER;
+        }
+        size_t next = i + (lens[i] & BLOCK_LEN);
+        if (insn.kind == INSN_JCC && next < size) lens[next] |= BLOCK_LEADER;
+    }
+    int rc = 0;
+    for (i = 0; rc == 0 && i < size; i += lens[i] & BLOCK_LEN) {
+        if (!(lens[i] & BLOCK_LEADER)) continue;
+        size_t end = i;
+        do {
+            bool ends = lens[end] & BLOCK_ENDS;
+            end += lens[end] & BLOCK_LEN;
+            if (ends) break;
+        } while (end < size && !(lens[end] & BLOCK_LEADER));
+        rc = add_block(c, addr + i, end - i, exec, nexec);
+    }
+    free(lens);
+    return rc;
+}
+
+/*
+ * Collect the basic blocks of the functions in the module's symbol table
+ * (the dynamic one if it was stripped) that land in executable mappings.
+ */
+static int find_blocks(Cover *c, const Range *exec, int nexec) {
+    int fd = open(c->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    Elf64_Ehdr eh;
+    Elf64_Phdr *ph = NULL;
+    Elf64_Shdr *sh = NULL;
+    Elf64_Sym *syms = NULL;
+    uint8_t *code = NULL;
+    size_t code_size = 0;
+    int rc = -1;
+    errno = ENOEXEC;
+    if (!read_at(fd, &eh, sizeof(eh), 0) || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh.e_ident[EI_CLASS] != ELFCLASS64 || eh.e_machine != EM_X86_64 ||
+        eh.e_phentsize != sizeof(Elf64_Phdr) || eh.e_shentsize != sizeof(Elf64_Shdr)) goto out;
+
+    // Position-independent modules are relocated by where their first segment went
+    ph = malloc(eh.e_phnum * sizeof(Elf64_Phdr));
+    sh = malloc(eh.e_shnum * sizeof(Elf64_Shdr));
+    if (ph == NULL || sh == NULL) goto out;
+    if (!read_at(fd, ph, eh.e_phnum * sizeof(Elf64_Phdr), eh.e_phoff) ||
+        !read_at(fd, sh, eh.e_shnum * sizeof(Elf64_Shdr), eh.e_shoff)) goto out;
+    uint64_t bias = 0;
+    if (eh.e_type == ET_DYN) {
+        uint64_t first = UINT64_MAX;
+        for (int i = 0; i < eh.e_phnum; i++) {
+            if (ph[i].p_type == PT_LOAD && ph[i].p_vaddr < first) first = ph[i].p_vaddr;
+        }
+        bias = c->base - (first & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1));
+    }
+
+    int symtab = -1;
+    for (int i = 0; i < eh.e_shnum; i++) {
+        if (sh[i].sh_type == SHT_SYMTAB || (sh[i].sh_type == SHT_DYNSYM && symtab == -1)) symtab = i;
+    }
+    if (symtab == -1 || sh[symtab].sh_entsize != sizeof(Elf64_Sym)) goto out;
+    size_t nsyms = sh[symtab].sh_size / sizeof(Elf64_Sym);
+    if ((syms = malloc(sh[symtab].sh_size)) == NULL) goto out;
+    if (!read_at(fd, syms, sh[symtab].sh_size, sh[symtab].sh_offset)) goto out;
+
+    c->nbps = 0;
+    for (size_t i = 0; i < nsyms; i++) {
+        Elf64_Sym *s = &syms[i];
+        if (ELF64_ST_TYPE(s->st_info) != STT_FUNC || s->st_value == 0 ||
+            s->st_shndx == SHN_UNDEF || s->st_shndx >= eh.e_shnum ||
+            !(sh[s->st_shndx].sh_flags & SHF_EXECINSTR)) continue;
+        Elf64_Shdr *sec = &sh[s->st_shndx];
+        uint64_t addr = s->st_value + bias;
+        // Without its code, a function can only be covered at its entry
+        if (s->st_size == 0 || sec->sh_type != SHT_PROGBITS || s->st_value < sec->sh_addr ||
+            s->st_value - sec->sh_addr + s->st_size > sec->sh_size) {
+            if (add_block(c, addr, 1, exec, nexec) == -1) goto out;
+            continue;
+        }
+        if (s->st_size > code_size) {
+            uint8_t *p = realloc(code, s->st_size);
+            if (p == NULL) goto out;
+            code = p;
+            code_size = s->st_size;
+        }
+        if (!read_at(fd, code, s->st_size, sec->sh_offset + s->st_value - sec->sh_addr) ||
+            add_function(c, addr, code, s->st_size, exec, nexec) == -1) goto out;
+    }
+    // Aliases share their blocks
+    qsort(c->bps, c->nbps, sizeof(Breakpoint), cmp_addr);
+    int n = 0;
+    for (int i = 0; i < c->nbps; i++) {
+        if (n == 0 || c->bps[i].addr != c->bps[n - 1].addr) c->bps[n++] = c->bps[i];
+    }
+    c->nbps = n;
+    rc = 0;
+out:
+    free(code);
+    free(syms);
+    free(sh);
+    free(ph);
+    close(fd);
+    return rc;
+}
+
+/*
+ * Save the byte under every breakpoint and write the int3s.  The process
+ * must not be running.  On failure the bytes already written are put back.
+ */
+static int plant(Cover *c) {
+    uint8_t int3 = INT3;
+    for (int i = 0; i < c->nbps; i++) {
+        Breakpoint *bp = &c->bps[i];
+        if (!read_at(c->mem_fd, &bp->orig, 1, bp->addr) ||
+            pwrite(c->mem_fd, &int3, 1, bp->addr) != 1) {
+            while (--i >= 0) pwrite(c->mem_fd, &c->bps[i].orig, 1, c->bps[i].addr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int cover_add(int deet_id, Cover *c) {
+    if (deet_id >= covers_size) {
+        int size = covers_size ? covers_size : 16;
+        while (size <= deet_id) size *= 2;
+        Cover **p = realloc(covers, size * sizeof(Cover *));
+        if (p == NULL) return -1;
+        memset(p + covers_size, 0, (size - covers_size) * sizeof(Cover *));
+        covers = p;
+        covers_size = size;
+    }
+    if (covers[deet_id] != NULL) cover_free(covers[deet_id]);
+    covers[deet_id] = c;
+    return 0;
+}
+
+/*
+ * Find the module in the current image of the process and its basic
+ * blocks, and open its memory.
+ */
+static int cover_load(Cover *c, pid_t pid) {
+    Range exec[16];
+    int nexec;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/mem", (int)pid);
+    if (find_module(pid, c->module, c, exec, &nexec, 16) == -1 ||
+        find_blocks(c, exec, nexec) == -1 ||
+        (c->hits = malloc((c->nbps + 1) * sizeof(int))) == NULL ||
+        (c->mem_fd = open(path, O_RDWR | O_CLOEXEC)) == -1) {
+        cover_unload(c);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Start covering a module (the main executable if NULL) of deet_id.  A
+ * running process is paused only while the breakpoints are written.  An
+ * exec is followed, so a process covered right after run, before it got
+ * to exec, is covered in the program it runs.
+ */
+int cover_start(int deet_id, const char *module, StrBuf *out) {
+#if defined(__x86_64__)
+    pid_t pid = ptable.pid[deet_id];
+    Cover *active = cover_get(deet_id);
+    if (active != NULL && active->mem_fd != -1) {
+        errno = EALREADY;
+        return -1;
+    }
+    // Threads that are not traced would be killed by the traps
+    if (thread_count(pid) != 1) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    Cover *c = calloc(1, sizeof(Cover));
+    if (c == NULL) return -1;
+    c->deet_id = deet_id;
+    c->mem_fd = -1;
+    if ((module != NULL && (c->module = strdup(module)) == NULL) ||
+        cover_load(c, pid) == -1 || trace_seize(deet_id, false) == -1) {
+        cover_free(c);
+        return -1;
+    }
+
+    // The table can say stopped before the stop signal has landed
+    char state = 0;
+    proc_start_time(pid, &state);
+    bool paused = state != 't' && state != 'T';
+    int sig = 0, rc;
+    if (paused && trace_pause(deet_id, &sig) == -1) {
+        cover_free(c);
+        return -1;
+    }
+    STATS_TIMED(HIST_PTRACE, rc = ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)COVER_OPTIONS));
+    if (rc == 0) rc = plant(c);
+    // If it is meant to be stopped, keep it in the interrupt stop
+    if (paused && !(ptable.state[deet_id] == PSTATE_STOPPED && (sig == 0 || sig == SIGSTOP))) {
+        trace_resume(deet_id, sig);
+    }
+    if (rc == -1 || cover_add(deet_id, c) == -1) {
+        cover_free(c);
+        return -1;
+    }
+    sb_printf(out, "%d breakpoints in %s\n", c->nbps, c->path);
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int cover_print(int deet_id, StrBuf *out) {
+    Cover *c = cover_get(deet_id);
+    if (c == NULL) return -1;
+    sb_printf(out, "%s: %d of %d blocks reached%s\n", c->path, c->nhits, c->nbps,
+              c->mem_fd == -1 ? " (finished)" : "");
+    return 0;
+}
+
+/*
+ * Write the blocks reached as a drcov (version 2) file with a single
+ * module.
+ */
+int cover_dump(int deet_id, const char *path) {
+    Cover *c = cover_get(deet_id);
+    if (c == NULL) return -1;
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return -1;
+    fprintf(f, "DRCOV VERSION: 2\nDRCOV FLAVOR: deet\n");
+    fprintf(f, "Module Table: version 2, count 1\n");
+    fprintf(f, "Columns: id, base, end, entry, checksum, timestamp, path\n");
+    fprintf(f, " 0, 0x%016llx, 0x%016llx, 0x%016llx, 0x%08x, 0x%08x, %s\n",
+            (unsigned long long)c->base, (unsigned long long)c->end, 0ull, 0, 0, c->path);
+    fprintf(f, "BB Table: %d bbs\n", c->nhits);
+    bool ok = true;
+    for (int i = 0; ok && i < c->nhits; i++) {
+        struct {
+            uint32_t start;
+            uint16_t size;
+            uint16_t mod_id;
+        } bb = { (uint32_t)(c->bps[c->hits[i]].addr - c->base), c->bps[c->hits[i]].size, 0 };
+        ok = fwrite(&bb, sizeof(bb), 1, f) == 1;
+    }
+    // A short file would still parse, as coverage that is missing
+    ok = !ferror(f) && ok;
+    if (fclose(f) != 0 || !ok) return -1;
+    return 0;
+}
+
+#if defined(__x86_64__)
+/*
+ * If the process, in a SIGTRAP stop, is at one of the breakpoints, retire
+ * it and back the instruction pointer up to the original instruction.
+ */
+static bool retire(Cover *c, pid_t pid) {
+    struct user_regs_struct regs;
+    long rc;
+    STATS_TIMED(HIST_PTRACE, rc = ptrace(PTRACE_GETREGS, pid, NULL, &regs));
+    if (rc == -1) return false;
+    Breakpoint key = { .addr = regs.rip - 1 };
+    Breakpoint *bp = bsearch(&key, c->bps, c->nbps, sizeof(Breakpoint), cmp_addr);
+    if (bp == NULL || bp->hit) return false;
+
+    if (pwrite(c->mem_fd, &bp->orig, 1, bp->addr) != 1) return false;
+    regs.rip = bp->addr;
+    STATS_TIMED(HIST_PTRACE, rc = ptrace(PTRACE_SETREGS, pid, NULL, &regs));
+    bp->hit = true;
+    c->hits[c->nhits++] = bp - c->bps;
+    return rc == 0;
+}
+#endif
+
+// Put back the original bytes of the breakpoints not hit, through fd
+static void unplant(Cover *c, int fd) {
+    for (int i = 0; i < c->nbps; i++) {
+        if (!c->bps[i].hit) pwrite(fd, &c->bps[i].orig, 1, c->bps[i].addr);
+    }
+}
+
+/*
+ * A stop of a process deet does not know.  It may be a task that a
+ * covered process just created, reporting before its parent's event.
+ */
+void cover_stray(pid_t pid, int status) {
+    if (!WIFSTOPPED(status)) return;
+    if (nstrays == MAX_STRAYS) memmove(strays, strays + 1, --nstrays * sizeof(pid_t));
+    strays[nstrays++] = pid;
+}
+
+// Wait for the first stop of a task attached because of a clone or fork
+static int wait_new_task(pid_t tid) {
+    for (int i = 0; i < nstrays; i++) {
+        if (strays[i] == tid) {
+            memmove(strays + i, strays + i + 1, (--nstrays - i) * sizeof(pid_t));
+            return 0;
+        }
+    }
+    int status;
+    while (waitpid(tid, &status, __WALL) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFSTOPPED(status) ? 0 : -1;
+}
+
+/*
+ * The process made a new task, which is attached and stopped.  A forked
+ * child gets the original code back in its copy of memory.  A thread, or
+ * a vfork() child, shares the memory: the breakpoints are taken out for
+ * good, as a task deet does not trace would be killed by them.  Either
+ * way the new task is let go.
+ */
+static void new_task(Cover *c, pid_t pid, int event) {
+    unsigned long msg = 0;
+    STATS_TIMED(HIST_PTRACE, ptrace(PTRACE_GETEVENTMSG, pid, NULL, &msg));
+    pid_t tid = msg;
+    if (tid <= 0 || wait_new_task(tid) == -1) return;
+    if (event == PTRACE_EVENT_FORK) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/mem", (int)tid);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd != -1) {
+            unplant(c, fd);
+            close(fd);
+        }
+    } else if (c->mem_fd != -1) {
+        unplant(c, c->mem_fd);
+        close(c->mem_fd);
+        c->mem_fd = -1;
+        warn("Process %d started a thread: coverage stopped", (int)pid);
+    }
+    STATS_TIMED(HIST_PTRACE, ptrace(PTRACE_DETACH, tid, NULL, NULL));
+}
+
+/*
+ * A seized process stopped.  If it was for one of deet_id's breakpoints,
+ * an exec that took them away, or a new task, deal with it, resume the
+ * process and return true.
+ */
+bool cover_trap(int deet_id, int status) {
+#if defined(__x86_64__)
+    Cover *c = cover_get(deet_id);
+    if (c == NULL || WSTOPSIG(status) != SIGTRAP) return false;
+
+    pid_t pid = ptable.pid[deet_id];
+    int event = status >> 16;
+    if (event == PTRACE_EVENT_EXEC) {
+        // The breakpoints went with the old image; start over in the new one
+        cover_unload(c);
+        if (cover_load(c, pid) == -1 || plant(c) == -1) {
+            cover_unload(c);
+            warn("Cannot cover process %d after exec", (int)pid);
+        }
+    } else if (event == PTRACE_EVENT_CLONE || event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK) {
+        new_task(c, pid, event);
+    } else if (c->mem_fd == -1 || status >> 16 != 0 || !retire(c, pid)) {
+        return false;
+    }
+    STATS_TIMED(HIST_PTRACE, ptrace(PTRACE_CONT, pid, NULL, NULL));
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Whether deet_id has breakpoints planted
+bool cover_active(int deet_id) {
+    Cover *c = cover_get(deet_id);
+    return c != NULL && c->mem_fd != -1;
+}
+
+/*
+ * deet_id is about to be detached, from a ptrace stop with *sig pending:
+ * take out the breakpoints it has not hit, which would otherwise kill it.
+ * The results are kept for cover <id>.
+ */
+void cover_release(int deet_id, int *sig) {
+    Cover *c = cover_get(deet_id);
+    if (c == NULL || c->mem_fd == -1) return;
+#if defined(__x86_64__)
+    if (*sig == SIGTRAP && retire(c, ptable.pid[deet_id])) *sig = 0;
+#endif
+    unplant(c, c->mem_fd);
+    close(c->mem_fd);
+    c->mem_fd = -1;
+}
+
+/*
+ * deet_id has terminated: write out its coverage and keep the results
+ * for cover <id>.
+ */
+void cover_exit(int deet_id) {
+    Cover *c = cover_get(deet_id);
+    if (c == NULL || c->mem_fd == -1) return;
+    close(c->mem_fd);
+    c->mem_fd = -1;
+
+    const char *dir = getenv(COVER_DIR_ENV);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/deet-%d.drcov", dir != NULL ? dir : ".", deet_id);
+    if (cover_dump(deet_id, path) == -1) warn("Cannot write %s", path);
+}
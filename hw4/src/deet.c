@@ -6,270 +6,694 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <poll.h>
 #include "helper.h"
 #include "debug.h"
 #include "deet.h"
 #include "deet_run.h"
+#include "stats.h"
+#include "strbuf.h"
+#include "show.h"
+#include "capture.h"
+#include "evloop.h"
+#include "trace.h"
+#include "statefile.h"
+#include "cgroup.h"
+#include "monitor.h"
+#include "agent.h"
+#include "cover.h"
 
-void run_deet(int silent_logging) {
-    struct sigaction sa;
-    sa.sa_handler = sigint_handler;
-    sa.sa_flags = 0; // or SA_RESTART
-    sigemptyset(&sa.sa_mask);
-    sigaddset(&sa.sa_mask, SIGCHLD); // Block SIGCHLD while handling SIGINT
+// State file given with --state, or NULL
+const char *deet_state_path;
 
-    if (sigaction(SIGINT, &sa, NULL) == -1) {
-        perror("sigaction");
-        exit(EXIT_FAILURE);
-    }
+bool deet_errors_to_output;
 
-    struct sigaction sa_chld;
-    sa_chld.sa_handler = sigchld_handler;
-    sa_chld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sigemptyset(&sa_chld.sa_mask);
+// Parsed argument vector and joined arguments, reused between commands
+static char **args;
+static size_t args_size;
+static char *command_line;
+static size_t command_line_size;
 
-    // Block other signals during SIGCHLD handling
-    sigaddset(&sa_chld.sa_mask, SIGINT);
-    sigaddset(&sa_chld.sa_mask, SIGTERM);
-    // Add other signals
+/*
+ * Join args with single spaces into *buf, growing it as needed.
+ */
+static void join_args(char **args, char **buf, size_t *size) {
+    size_t len = 1;
+    for (int j = 0; args[j] != NULL; j++) len += strlen(args[j]) + 1;
+    if (len > *size) {
+        if ((*buf = realloc(*buf, len)) == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        *size = len;
+    }
+    char *p = *buf;
+    for (int j = 0; args[j] != NULL; j++) {
+        if (j > 0) *p++ = ' ';
+        size_t n = strlen(args[j]);
+        memcpy(p, args[j], n);
+        p += n;
+    }
+    *p = 0;
+}
 
-    if (sigaction(SIGCHLD, &sa_chld, NULL) == -1) {
-        perror("sigaction");
-        exit(EXIT_FAILURE);
+// Report a failed call made for a command, like perror()
+static void command_perror(StrBuf *out, const char *what) {
+    if (deet_errors_to_output) {
+        sb_printf(out, "%s: %s\n", what, strerror(errno));
+    } else {
+        perror(what);
     }
+}
 
-    char input[256];
-    log_startup(); // Log startup
+bool wait_satisfied(const WaitTarget *wait) {
+    PSTATE state = ptable.state[wait->deet_id];
+    return state == wait->state || state == PSTATE_DEAD;
+}
+
+/*
+ * Execute one command line, appending everything it prints to out.
+ * line is modified in place.  A CMD_WAIT result means the command is
+ * complete once wait_satisfied(wait) holds.
+ */
+int deet_command(char *line, StrBuf *out, WaitTarget *wait) {
+    // Remove newline character from input
+    line[strcspn(line, "\n")] = 0;
+    STATS_INC(CNT_COMMANDS);
 
-    // Counter for number of processes
-    static int deet_id_counter = 0;
+    // Parse the input into command and arguments
+    char *command = strtok(line, " ");
+    if (command == NULL) {
+        log_error("Invalid command");
+        sb_printf(out, "?\n");
+        return CMD_ERROR;
+    }
 
-    while (1) {
-        if (sigchld_received) {
-            handle_sigchld();
+    int argc = 0;
+    for (;;) {
+        if ((size_t)argc >= args_size) {
+            args_size = args_size ? args_size * 2 : 16;
+            if ((args = realloc(args, args_size * sizeof(char *))) == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
         }
+        if ((args[argc] = strtok(NULL, " ")) == NULL) break;
+        argc++;
+    }
 
-        log_prompt(); // Log prompt
-        printf("deet> ");
+    // Concatenate command line arguments
+    join_args(args, &command_line, &command_line_size);
 
-        if (fgets(input, sizeof(input), stdin) == NULL) {
-            if (feof(stdin)) {
-                // End of file reached, handle as needed, maybe exit
-                printf("\nEnd of input, exiting.\n");
-                break;
+    // Execute commands
+    if (strcmp(command, "help") == 0) {
+        // Display help information
+        log_input("help\n"); // Log the help command
+        sb_printf(out, "Available commands:\n");
+        sb_printf(out, "help -- Print this help message\n");
+        sb_printf(out, "quit (<=0 args) -- Quit the program\n");
+        sb_printf(out, "show [id|lo-hi] [state=s,...] [traced|untraced] [cmd=str] [sort=id|pid|state|cmd] -- Show process info\n");
+        sb_printf(out, "run [--capture] [--agent] [--group name] (>=1 args) -- Start a process, optionally capturing its output, with the agent or in a group\n");
+        sb_printf(out, "attach (1 args) -- Attach to and stop a running process by PID\n");
+        sb_printf(out, "stop (1 args) -- Stop a running process\n");
+        sb_printf(out, "cont (1 args) -- Continue a stopped process\n");
+        sb_printf(out, "release (1 args) -- Stop tracing a process, allowing it to continue normally\n");
+        sb_printf(out, "wait (1-2 args) -- Wait for a process to enter a specified state or terminate\n");
+        sb_printf(out, "kill (1 args) -- Forcibly terminate a process\n");
+        sb_printf(out, "freeze (1 args) -- Stop every process in a group\n");
+        sb_printf(out, "thaw (1 args) -- Continue every process in a group\n");
+        sb_printf(out, "groups (0 args) -- Show groups with their CPU and memory use\n");
+        sb_printf(out, "monitor (1-4 args) -- Sample memory of a process without stopping it; show, stop or export samples\n");
+        sb_printf(out, "agent (1-2 args) -- Show metrics published by a process's agent, or request a backtrace with bt\n");
+        sb_printf(out, "cover (1-3 args) -- Record which basic blocks of a process run, or write them out with dump\n");
+        sb_printf(out, "peek (2-3 args) -- Read from the address space of a traced process\n");
+        sb_printf(out, "poke (3 args) -- Write to the address space of a traced process\n");
+        sb_printf(out, "bt (1 args) -- Show a stack trace for a traced process\n");
+        sb_printf(out, "output (1-3 args) -- Show captured output of a process, or its last N lines with tail N\n");
+        sb_printf(out, "stats (0-3 args) -- Show or reset internal counters, or dump them periodically\n");
+    } else if (strcmp(command, "quit") == 0) {
+        log_input("quit\n"); // Log the quit command
+
+        // Iterate through the process table and terminate each process
+        // for (int i = 0; i < process_count; i++) {
+        //     if (process_table[i].state != PSTATE_DEAD) {
+        //         kill(process_table[i].pid, SIGTERM); // Send SIGTERM to each process
+        //         waitpid(process_table[i].pid, NULL, 0); // Wait for the process to terminate
+        //     }
+        // }
+
+        return CMD_QUIT;
+    } else if (strcmp(command, "show") == 0) {
+        log_input(command_line);
+        if (silent_logging == 0) {
+            sb_printf(out, "\n"); // Only print newline if logging is not silent
+        }
+        // Show process info, assembled in one buffer and written at once
+        if (show_processes(out, args) == -1) {
+            log_error("Invalid show arguments");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+    } else if (strcmp(command, "run") == 0) {
+        log_input(command_line);
+        if (silent_logging == 0) {
+            sb_printf(out, "\n"); // Only print newline if logging is not silent
+        }
+
+        // Options come before the command to run
+        char **run_args = args;
+        int run_argc = argc;
+        bool capture = false;
+        bool agent = false;
+        const char *group = NULL;
+        while (run_args[0] != NULL && strncmp(run_args[0], "--", 2) == 0) {
+            if (strcmp(run_args[0], "--capture") == 0) {
+                capture = true;
+            } else if (strcmp(run_args[0], "--agent") == 0) {
+                agent = true;
+            } else if (strcmp(run_args[0], "--group") == 0 && run_args[1] != NULL) {
+                group = *++run_args;
+                run_argc--;
             } else {
-                // Input error, handle or report error
-                perror("fgets");
-                continue;
+                break;
             }
+            run_args++;
+            run_argc--;
         }
+        if (run_args != args) join_args(run_args, &command_line, &command_line_size);
 
-        // Remove newline character from input
-        input[strcspn(input, "\n")] = 0;
-
-        // Parse the input into command and arguments
-        char *command = strtok(input, " ");
-        if (command == NULL) {
-            log_error("Invalid command");
-            printf("?\n");
-            continue;
-        }
-
-        char *args[10];
-        int i = 0;
-        while (i < 10 && (args[i] = strtok(NULL, " ")) != NULL) i++;
-
-        // Concatenate command line arguments
-        char command_line[256] = {0};
-        for (int j = 0; args[j] != NULL; j++) {
-            strcat(command_line, args[j]);
-            if (args[j + 1] != NULL) strcat(command_line, " ");
-        }
-
-        // Execute commands
-        if (strcmp(command, "help") == 0) {
-            // Display help information
-            log_input("help\n"); // Log the help command
-            printf("Available commands:\n");
-            printf("help -- Print this help message\n");
-            printf("quit (<=0 args) -- Quit the program\n");
-            printf("show (<=1 args) -- Show process info\n");
-            printf("run (>=1 args) -- Start a process\n");
-            printf("stop (1 args) -- Stop a running process\n");
-            printf("cont (1 args) -- Continue a stopped process\n");
-            printf("release (1 args) -- Stop tracing a process, allowing it to continue normally\n");
-            printf("wait (1-2 args) -- Wait for a process to enter a specified state or terminate\n");
-            printf("kill (1 args) -- Forcibly terminate a process\n");
-            printf("peek (2-3 args) -- Read from the address space of a traced process\n");
-            printf("poke (3 args) -- Write to the address space of a traced process\n");
-            printf("bt (1 args) -- Show a stack trace for a traced process\n");
-        } else if (strcmp(command, "quit") == 0) {
-            log_input("quit\n"); // Log the quit command
-
-            // Iterate through the process table and terminate each process
-            // for (int i = 0; i < process_count; i++) {
-            //     if (process_table[i].state != PSTATE_DEAD) {
-            //         kill(process_table[i].pid, SIGTERM); // Send SIGTERM to each process
-            //         waitpid(process_table[i].pid, NULL, 0); // Wait for the process to terminate
-            //     }
-            // }
+        if (run_args[0] == NULL) {
+            log_error("No command given");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
 
-            log_shutdown(); // Log shutdown
-            break;
-        } else if (strcmp(command, "show") == 0) {
-            log_input(command_line);
-            if (silent_logging == 0) {
-                printf("\n"); // Only print newline if logging is not silent
-            }
-            // Show process info
-            int specific_deet_id = -1; // Default to -1, indicating no specific deet ID provided
-                if (args[0] != NULL) {
-                    specific_deet_id = atoi(args[0]); // Convert argument to integer
-                }
-
-                int found = 0; // Flag to check if any process is found
-                for (int i = 0; i < process_count; i++) {
-                        if (specific_deet_id == -1 || process_table[i].deet_id == specific_deet_id) {
-                            char state_char = process_table[i].traced ? 'T' : 'U';
-                            char *state_desc = "unknown";
-
-                            switch (process_table[i].state) {
-                                case PSTATE_RUNNING:
-                                    state_desc = "running";
-                                    break;
-                                case PSTATE_STOPPED:
-                                    state_desc = "stopped";
-                                    break;
-                                case PSTATE_DEAD:
-                                    state_desc = "dead";
-                                    break;
-                                case PSTATE_NONE:
-                                    state_desc = "none";
-                                    break;
-                                case PSTATE_STOPPING:
-                                    state_desc = "stopped";
-                                    break;
-                                case PSTATE_CONTINUING:
-                                    state_desc = "continuing";
-                                    break;
-                                case PSTATE_KILLED:
-                                    state_desc = "killed";
-                                    break;
-                                default:
-                                    state_desc = "unknown";
-                            }
-
-                            printf("%d\t%d\t%c\t%s\t\t%s\n",
-                                   process_table[i].deet_id, process_table[i].pid, state_char, state_desc, process_table[i].command_line);
-                            found = 1;
-                            if (specific_deet_id != -1) break;
-                        }
-                    }
-                if (!found) {
-                    if (specific_deet_id == -1) {
-                        printf("No processes are currently being managed.\n");
-                    } else {
-                        printf("No process found with Deet ID: %d\n", specific_deet_id);
-                    }
-                }
-        } else if (strcmp(command, "run") == 0) {
-            log_input(command_line);
-            if (silent_logging == 0) {
-                printf("\n"); // Only print newline if logging is not silent
-            }
+        CapturePipes pipes;
+        if (capture && capture_prepare(&pipes) == -1) {
+            command_perror(out, "pipe");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
 
-            // Start a process
-            pid_t pid = fork();
+        AgentLaunch agent_launch = { .fd = -1, .lib = NULL };
+        if (agent && agent_prepare(&agent_launch) == -1) {
+            if (capture) capture_abort(&pipes);
+            log_error("Cannot set up agent");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
 
-            if (pid == -1) {
-                perror("fork");
-                // Handle fork error
-            } else if (pid == 0) {
-                // Child process
-                execvp(args[0], args);
-                perror("execvp"); // execvp only returns on error
-                exit(EXIT_FAILURE);
-            } else if (pid > 0) {
-                // Parent process
-                int deet_id = deet_id_counter++;
-                if (process_count < MAX_PROCESSES) {
-                    process_table[process_count].pid = pid;
-                    process_table[process_count].deet_id = deet_id;
-                    strncpy(process_table[process_count].command_line, command_line, sizeof(process_table[process_count].command_line));
-                    process_table[process_count].traced = true;  // Set traced flag to true
-                    process_table[process_count].state = PSTATE_RUNNING; // Initially stopped due to SIGSTOP
-                    process_count++;
-                } else {
-                    // Handle error: too many processes
-                }
-                log_state_change(pid, PSTATE_NONE, PSTATE_RUNNING, 0); // Log state change to running
-
-                // Display process information
-                printf("%d\t%d\tT\t%s\t\t%s\n", deet_id, pid, "running", command_line);
-
-                // Stop the child process immediately
-                log_signal(SIGCHLD);
-                log_state_change(pid, PSTATE_RUNNING, PSTATE_STOPPED, 0);
-                printf("%d\t%d\tT\t%s\t\t%s\n", deet_id, pid, "stopped", command_line);
-                process_table[process_count - 1].state = PSTATE_STOPPED; // Initially stopped due to SIGSTOP
-                kill(pid, SIGSTOP);
-
-                // Display process information again after stopping
-                //printf("%d\t%d\tT\t%s\t\t%s\n", deet_id, pid, "stopped", command_line);
+        GroupLaunch launch = { .group = -1, .procs_fd = -1 };
+        if (group != NULL && group_prepare(group, &launch) == -1) {
+            if (capture) capture_abort(&pipes);
+            agent_abort(&agent_launch);
+            log_error("Cannot use group");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+
+        // Hold SIGCHLD until the child is in the table
+        sigset_t chld_mask, old_mask;
+        sigemptyset(&chld_mask);
+        sigaddset(&chld_mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+
+        // Start a process
+        pid_t pid = fork();
+
+        if (pid == -1) {
+            command_perror(out, "fork");
+            // Handle fork error
+            if (capture) capture_abort(&pipes);
+            group_abort(&launch);
+            agent_abort(&agent_launch);
+        } else if (pid == 0) {
+            // Child process: SIGCHLD may also be blocked for a signalfd
+            sigdelset(&old_mask, SIGCHLD);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            group_child(&launch);
+            if (capture) capture_child(&pipes);
+            if (agent) agent_child(&agent_launch);
+            execvp(run_args[0], run_args);
+            perror("execvp"); // execvp only returns on error
+            exit(EXIT_FAILURE);
+        } else if (pid > 0) {
+            // Parent process
+            int deet_id = ptable_add(pid, run_argc, run_args);
+            if (deet_id == -1) {
+                // Out of memory: do not leave an untracked child behind
+                kill(pid, SIGKILL);
+                if (capture) capture_abort(&pipes);
+                group_abort(&launch);
+                agent_abort(&agent_launch);
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                log_error("Cannot track process");
+                sb_printf(out, "?\n");
+                return CMD_ERROR;
             }
-        } else if (strcmp(command, "stop") == 0) {
-            // Stop a running process
-        } else if (strcmp(command, "cont") == 0) {
-            log_input(command_line);
-            // Continue a stopped process
-            if (args[0] == NULL) {
-                printf("No Deet ID provided\n");
-                continue;
+            if (capture && capture_start(deet_id, &pipes) == -1) {
+                warn("Cannot capture output of process %d", deet_id);
             }
+            group_start(deet_id, &launch);
+            if (agent && agent_start(deet_id, &agent_launch) == -1) {
+                warn("Cannot map agent region of process %d", deet_id);
+            }
+            STATS_INC(CNT_SPAWNED);
+            log_state_change(pid, PSTATE_NONE, PSTATE_RUNNING, 0); // Log state change to running
 
-            // Extract the PID from the command arguments
-            int deet_id_to_continue = atoi(args[0]); // Extract Deet ID from args
-            pid_t pid_to_continue = get_pid(deet_id_to_continue); // Convert Deet ID to PID
+            // Display process information
+            sb_printf(out, "%d\t%d\tT\t%s\t\t%s\n", deet_id, pid, "running", command_line);
 
-            if (pid_to_continue == -1) {
-                printf("Invalid Deet ID: %d\n", deet_id_to_continue);
-                continue;
+            // Stop the child process immediately
+            log_signal(SIGCHLD);
+            log_state_change(pid, PSTATE_RUNNING, PSTATE_STOPPED, 0);
+            sb_printf(out, "%d\t%d\tT\t%s\t\t%s\n", deet_id, pid, "stopped", command_line);
+            ptable_set_state(deet_id, PSTATE_STOPPED); // Initially stopped due to SIGSTOP
+            if (!group_frozen(deet_id)) {
+                // A frozen group's cgroup has already stopped it
+                STATS_TIMED(HIST_SIGNAL, kill(pid, SIGSTOP));
             }
 
-            // Send SIGCONT to the specified process
-            kill(pid_to_continue, SIGCONT);
-            log_state_change(pid_to_continue, PSTATE_STOPPED, PSTATE_RUNNING, 0);
-
-            // Update the process state in the process table
-            update_process_state(pid_to_continue, PSTATE_RUNNING);
-        } else if (strcmp(command, "release") == 0) {
-            // Stop tracing a process
-        } else if (strcmp(command, "wait") == 0) {
-            // Wait for a process
-        } else if (strcmp(command, "kill") == 0) {
-            log_input(command_line);
-            // Terminate a process
-            if (args[0] == NULL) {
-                printf("No PID provided\n");
-                continue;
+            // Display process information again after stopping
+            //sb_printf(out, "%d\t%d\tT\t%s\t\t%s\n", deet_id, pid, "stopped", command_line);
+        }
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    } else if (strcmp(command, "stop") == 0) {
+        // Stop a running process
+    } else if (strcmp(command, "cont") == 0) {
+        log_input(command_line);
+        // Continue a stopped process
+        if (args[0] == NULL) {
+            sb_printf(out, "No Deet ID provided\n");
+            return CMD_ERROR;
+        }
+
+        // Extract the PID from the command arguments
+        int deet_id_to_continue = atoi(args[0]); // Extract Deet ID from args
+        pid_t pid_to_continue = get_pid(deet_id_to_continue); // Convert Deet ID to PID
+
+        if (pid_to_continue == -1) {
+            sb_printf(out, "Invalid Deet ID: %d\n", deet_id_to_continue);
+            return CMD_ERROR;
+        }
+
+        if (group_frozen(deet_id_to_continue)) {
+            log_error("Process is frozen with its group");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+
+        // Send SIGCONT to the specified process, or resume it from its ptrace stop
+        if (ptable.seized[deet_id_to_continue]) {
+            if (trace_cont(deet_id_to_continue) == -1) {
+                log_error("Cannot continue process");
+                sb_printf(out, "?\n");
+                return CMD_ERROR;
             }
+        } else {
+            STATS_TIMED(HIST_SIGNAL, kill(pid_to_continue, SIGCONT));
+        }
+        log_state_change(pid_to_continue, PSTATE_STOPPED, PSTATE_RUNNING, 0);
 
-            pid_t pid_to_kill = atoi(args[0]); // Extract PID from args
+        // Update the process state in the process table
+        update_process_state(pid_to_continue, PSTATE_RUNNING);
+    } else if (strcmp(command, "attach") == 0) {
+        log_input(command_line);
+        if (silent_logging == 0) {
+            sb_printf(out, "\n"); // Only print newline if logging is not silent
+        }
+        // Start managing an existing process
+        if (args[0] == NULL) {
+            sb_printf(out, "No PID provided\n");
+            return CMD_ERROR;
+        }
+        pid_t pid_to_attach = atoi(args[0]);
+        int deet_id = trace_attach(pid_to_attach);
+        if (deet_id == -1) {
+            command_perror(out, "attach");
+            log_error("Cannot attach to process");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+        sb_printf(out, "%d\t%d\tT\t%s\t\t%s\n", deet_id, pid_to_attach,
+                  pstate_name(ptable.state[deet_id]), ptable_command_line(deet_id));
+    } else if (strcmp(command, "release") == 0) {
+        log_input(command_line);
+        // Stop tracing a process
+        if (args[0] == NULL) {
+            sb_printf(out, "No Deet ID provided\n");
+            return CMD_ERROR;
+        }
+        int deet_id_to_release = atoi(args[0]);
+        if (get_pid(deet_id_to_release) == -1) {
+            sb_printf(out, "Invalid Deet ID: %d\n", deet_id_to_release);
+            return CMD_ERROR;
+        }
+        if (!ptable.traced[deet_id_to_release] || ptable.state[deet_id_to_release] == PSTATE_DEAD) {
+            log_error("Process is not traced");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+        if (trace_release(deet_id_to_release) == -1) {
+            command_perror(out, "release");
+            log_error("Cannot release process");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+    } else if (strcmp(command, "wait") == 0) {
+        log_input(command_line);
+        // Wait for a process to reach a state, by default to terminate
+        if (args[0] == NULL) {
+            sb_printf(out, "No Deet ID provided\n");
+            return CMD_ERROR;
+        }
+        int deet_id_to_wait = atoi(args[0]);
+        if (get_pid(deet_id_to_wait) == -1) {
+            sb_printf(out, "Invalid Deet ID: %d\n", deet_id_to_wait);
+            return CMD_ERROR;
+        }
+        int wanted = args[1] != NULL ? pstate_parse(args[1]) : PSTATE_DEAD;
+        if (wanted == -1) {
+            log_error("Invalid state");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
 
-            if (kill(pid_to_kill, SIGTERM) == -1) {
-                perror("kill");
-            } else {
-                log_state_change(pid_to_kill, PSTATE_RUNNING, PSTATE_KILLED, 0);
+        // The caller blocks (or defers the reply) until the state is reached
+        wait->deet_id = deet_id_to_wait;
+        wait->state = wanted;
+        if (!wait_satisfied(wait)) return CMD_WAIT;
+    } else if (strcmp(command, "kill") == 0) {
+        log_input(command_line);
+        // Terminate a process
+        if (args[0] == NULL) {
+            sb_printf(out, "No PID provided\n");
+            return CMD_ERROR;
+        }
+
+        pid_t pid_to_kill = atoi(args[0]); // Extract PID from args
+
+        int rc;
+        STATS_TIMED(HIST_SIGNAL, rc = kill(pid_to_kill, SIGTERM));
+        if (rc == -1) {
+            command_perror(out, "kill");
+        } else {
+            log_state_change(pid_to_kill, PSTATE_RUNNING, PSTATE_KILLED, 0);
+        }
+    } else if (strcmp(command, "freeze") == 0 || strcmp(command, "thaw") == 0) {
+        log_input(command_line);
+        // Stop or continue every process in a group at once
+        if (args[0] == NULL) {
+            sb_printf(out, "No group provided\n");
+            return CMD_ERROR;
+        }
+        if (group_freeze(args[0], strcmp(command, "freeze") == 0) == -1) {
+            log_error("Cannot change group state");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+    } else if (strcmp(command, "groups") == 0) {
+        log_input(command_line);
+        group_list(out);
+    } else if (strcmp(command, "monitor") == 0) {
+        log_input(command_line);
+        // Sample memory of a running process, or show, stop or export the samples
+        if (args[0] == NULL) {
+            sb_printf(out, "No Deet ID provided\n");
+            return CMD_ERROR;
+        }
+        int deet_id = atoi(args[0]);
+        int rc;
+        if (args[1] == NULL) {
+            rc = monitor_print(deet_id, out);
+        } else if (strcmp(args[1], "stop") == 0) {
+            rc = monitor_stop(deet_id);
+        } else if (strcmp(args[1], "export") == 0 && args[2] != NULL) {
+            rc = monitor_export(deet_id, args[2]);
+        } else if (args[2] != NULL && args[3] != NULL) {
+            if (get_pid(deet_id) == -1 || ptable.state[deet_id] == PSTATE_DEAD) {
+                sb_printf(out, "Invalid Deet ID: %d\n", deet_id);
+                return CMD_ERROR;
+            }
+            char *end;
+            uintptr_t addr = strtoul(args[1], &end, 0);
+            rc = *end != 0 ? -1 : monitor_add(deet_id, addr, atoi(args[2]), atoi(args[3]));
+            if (rc == -1) command_perror(out, "monitor");
+        } else {
+            rc = -1;
+        }
+        if (rc == -1) {
+            log_error("Invalid monitor arguments");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+    } else if (strcmp(command, "agent") == 0) {
+        log_input(command_line);
+        // Read what the in-process agent publishes, or ask it for a backtrace
+        if (args[0] == NULL) {
+            sb_printf(out, "No Deet ID provided\n");
+            return CMD_ERROR;
+        }
+        int deet_id = atoi(args[0]);
+        int rc;
+        if (args[1] == NULL) {
+            rc = agent_print(deet_id, out);
+        } else if (strcmp(args[1], "bt") == 0) {
+            if (get_pid(deet_id) != -1 && ptable.state[deet_id] == PSTATE_DEAD) {
+                log_error("Process has terminated");
+                sb_printf(out, "?\n");
+                return CMD_ERROR;
             }
-        } else if (strcmp(command, "peek") == 0) {
-            // Read from address space
-        } else if (strcmp(command, "poke") == 0) {
-            // Write to address space
-        } else if (strcmp(command, "bt") == 0) {
-            // Show a stack trace
+            rc = agent_backtrace(deet_id, out);
         } else {
-            log_error("Invalid command");
-            printf("?\n");
+            log_error("Invalid agent arguments");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+        if (rc == -1) {
+            sb_printf(out, "No agent for Deet ID: %d\n", deet_id);
+            return CMD_ERROR;
+        }
+    } else if (strcmp(command, "cover") == 0) {
+        log_input(command_line);
+        // Plant one-shot breakpoints in a module, or report or write out coverage
+        if (args[0] == NULL) {
+            sb_printf(out, "No Deet ID provided\n");
+            return CMD_ERROR;
+        }
+        int deet_id = atoi(args[0]);
+        if (get_pid(deet_id) == -1) {
+            sb_printf(out, "Invalid Deet ID: %d\n", deet_id);
+            return CMD_ERROR;
+        }
+        int rc;
+        if (args[1] != NULL && strcmp(args[1], "dump") == 0) {
+            if (args[2] == NULL) {
+                log_error("No file provided");
+                sb_printf(out, "?\n");
+                return CMD_ERROR;
+            }
+            rc = cover_dump(deet_id, args[2]);
+        } else if (args[1] == NULL && cover_print(deet_id, out) == 0) {
+            rc = 0;
+        } else if (ptable.state[deet_id] == PSTATE_DEAD) {
+            log_error("Process has terminated");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        } else {
+            rc = cover_start(deet_id, args[1], out);
+        }
+        if (rc == -1) {
+            command_perror(out, "cover");
+            log_error("Cannot record coverage");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+    } else if (strcmp(command, "peek") == 0) {
+        // Read from address space
+    } else if (strcmp(command, "poke") == 0) {
+        // Write to address space
+    } else if (strcmp(command, "bt") == 0) {
+        // Show a stack trace
+    } else if (strcmp(command, "output") == 0) {
+        log_input(command_line);
+        // Show captured output, optionally only the last N lines
+        if (args[0] == NULL) {
+            sb_printf(out, "No Deet ID provided\n");
+            return CMD_ERROR;
+        }
+        int deet_id = atoi(args[0]);
+        int tail = 0;
+        if (args[1] != NULL) {
+            if (strcmp(args[1], "tail") != 0 || args[2] == NULL || (tail = atoi(args[2])) <= 0) {
+                log_error("Invalid output arguments");
+                sb_printf(out, "?\n");
+                return CMD_ERROR;
+            }
+        }
+        if (capture_output(deet_id, tail, out) == -1) {
+            sb_printf(out, "No captured output for Deet ID: %d\n", deet_id);
+            return CMD_ERROR;
+        }
+    } else if (strcmp(command, "stats") == 0) {
+        log_input(command_line);
+        // Show, reset or periodically dump internal counters
+        if (args[0] == NULL) {
+            stats_print(out);
+        } else if (strcmp(args[0], "reset") == 0) {
+            stats_reset();
+        } else if (strcmp(args[0], "dump") == 0 && args[1] != NULL && strcmp(args[1], "off") == 0) {
+            stats_stop_dump();
+        } else if (strcmp(args[0], "dump") == 0 && args[1] != NULL) {
+            int interval = args[2] != NULL ? atoi(args[2]) : 10;
+            if (stats_start_dump(args[1], interval) == -1) {
+                log_error("Cannot dump stats");
+                sb_printf(out, "?\n");
+                return CMD_ERROR;
+            }
+        } else {
+            log_error("Invalid stats arguments");
+            sb_printf(out, "?\n");
+            return CMD_ERROR;
+        }
+    } else {
+        log_error("Invalid command");
+        sb_printf(out, "?\n");
+        return CMD_ERROR;
+    }
+    return CMD_OK;
+}
+
+
+// State of the interactive prompt
+static StrBuf input;
+static StrBuf output;
+static WaitTarget pending_wait;
+static bool waiting;
+static bool input_eof;
+static bool done;
+
+static void stdin_event(int fd, short revents, void *data);
+
+static void prompt(void) {
+    log_prompt(); // Log prompt
+    printf("deet> ");
+    fflush(stdout);
+}
+
+/*
+ * Execute the complete lines buffered from stdin, stopping at a command
+ * that has to wait.  stdin is taken out of the loop while a wait is
+ * outstanding.
+ */
+static void process_input(void) {
+    size_t start = 0;
+    while (!waiting && !done) {
+        char *nl = memchr(input.data + start, '\n', input.len - start);
+        if (nl == NULL) break;
+        *nl = 0;
+        char *line = input.data + start;
+        start = nl - input.data + 1;
+
+        sb_clear(&output);
+        int result = deet_command(line, &output, &pending_wait);
+        fflush(stdout);
+        sb_write(&output, STDOUT_FILENO);
+
+        if (result == CMD_WAIT) {
+            waiting = true;
+            if (!input_eof) ev_remove(STDIN_FILENO);
+        } else if (result == CMD_QUIT) {
+            ptable_kill_all();
+            log_shutdown(); // Log shutdown
+            done = true;
+        } else {
+            prompt();
+        }
+    }
+    if (start > 0) {
+        memmove(input.data, input.data + start, input.len - start);
+        input.len -= start;
+    }
+    if (input_eof && !waiting && !done) {
+        // End of file reached, handle as needed, maybe exit
+        printf("\nEnd of input, exiting.\n");
+        done = true;
+    }
+}
+
+static void stdin_event(int fd, short revents, void *data) {
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            // Input error, handle or report error
+            perror("read");
+            done = true;
+        }
+        return;
+    }
+    if (n == 0) {
+        // A last line without a newline still counts
+        if (input.len > 0) sb_append(&input, "\n", 1);
+        input_eof = true;
+        ev_remove(fd);
+        process_input();
+        return;
+    }
+    sb_append(&input, buf, n);
+    process_input();
+}
+
+void run_deet(int silent_logging) {
+    struct sigaction sa;
+    sa.sa_handler = sigint_handler;
+    sa.sa_flags = 0; // or SA_RESTART
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGCHLD); // Block SIGCHLD while handling SIGINT
+
+    if (sigaction(SIGINT, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    // Child state changes, stdin and captured output share one event loop
+    int sfd = sigchld_fd_open();
+    if (sfd == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    if (ev_add(sfd, POLLIN, sigchld_fd_event, NULL) == -1 ||
+        ev_add(STDIN_FILENO, POLLIN, stdin_event, NULL) == -1) {
+        perror("ev_add");
+        exit(EXIT_FAILURE);
+    }
+
+    stats_init();
+    log_startup(); // Log startup
+    if (deet_state_path != NULL && trace_restore(deet_state_path) == -1) {
+        perror(deet_state_path);
+    }
+    prompt();
+
+    while (!done) {
+        if (ev_poll(-1) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (waiting && wait_satisfied(&pending_wait)) {
+            waiting = false;
+            if (!input_eof) ev_add(STDIN_FILENO, POLLIN, stdin_event, NULL);
+            prompt();
+            process_input();
         }
+        stats_service();
     }
+    sb_free(&output);
+    sb_free(&input);
+    // quit has already dealt with every process; end of input has not
+    trace_shutdown();
+    statefile_close();
+    group_cleanup();
+    close(sfd);
 }
@@ -0,0 +1,91 @@
+#include <poll.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "evloop.h"
+
+typedef struct {
+    ev_handler handler;
+    void *data;
+} EvEntry;
+
+static struct pollfd *pfds;
+static EvEntry *entries;
+static int nfds;
+static int capacity;
+
+static int ev_find(int fd) {
+    for (int i = 0; i < nfds; i++) {
+        if (pfds[i].fd == fd) return i;
+    }
+    return -1;
+}
+
+int ev_add(int fd, short events, ev_handler handler, void *data) {
+    if (nfds == capacity) {
+        int cap = capacity ? capacity * 2 : 16;
+        struct pollfd *p = realloc(pfds, cap * sizeof(*pfds));
+        if (p == NULL) return -1;
+        pfds = p;
+        EvEntry *e = realloc(entries, cap * sizeof(*entries));
+        if (e == NULL) return -1;
+        entries = e;
+        capacity = cap;
+    }
+    pfds[nfds].fd = fd;
+    pfds[nfds].events = events;
+    pfds[nfds].revents = 0;
+    entries[nfds].handler = handler;
+    entries[nfds].data = data;
+    nfds++;
+    return 0;
+}
+
+int ev_set_events(int fd, short events) {
+    int i = ev_find(fd);
+    if (i == -1) return -1;
+    pfds[i].events = events;
+    return 0;
+}
+
+/*
+ * Safe to call from a handler: the slot is only marked here and is
+ * compacted away once the current dispatch pass is over.
+ */
+void ev_remove(int fd) {
+    int i = ev_find(fd);
+    if (i != -1) {
+        pfds[i].fd = -1;
+        entries[i].handler = NULL;
+    }
+}
+
+static void ev_compact(void) {
+    int j = 0;
+    for (int i = 0; i < nfds; i++) {
+        if (entries[i].handler == NULL) continue;
+        pfds[j] = pfds[i];
+        entries[j] = entries[i];
+        j++;
+    }
+    nfds = j;
+}
+
+/*
+ * Wait up to timeout_ms for activity and dispatch it.  Returns the number
+ * of descriptors handled, or -1 with errno set (EINTR included).
+ */
+int ev_poll(int timeout_ms) {
+    ev_compact();
+    int n = poll(pfds, nfds, timeout_ms);
+    if (n <= 0) return n;
+    int count = nfds; // Handlers added during dispatch wait for the next pass
+    int handled = 0;
+    for (int i = 0; i < count; i++) {
+        short revents = pfds[i].revents;
+        if (revents == 0 || entries[i].handler == NULL) continue;
+        pfds[i].revents = 0;
+        entries[i].handler(pfds[i].fd, revents, entries[i].data);
+        handled++;
+    }
+    return handled;
+}
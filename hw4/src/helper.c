@@ -6,33 +6,247 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <sys/signalfd.h>
 #include "helper.h"
 #include "debug.h"
 #include "deet.h"
 #include "deet_run.h"
+#include "stats.h"
+#include "statefile.h"
+#include "trace.h"
+#include "cover.h"
+#include "capture.h"
 
 // Global flag for SIGCHLD signal
 volatile sig_atomic_t sigchld_received = 0;
 
-ProcessInfo process_table[MAX_PROCESSES];
-int process_count = 0;
+// Arrival time of the SIGCHLD being handled, 0 if none, for state update latency
+static uint64_t sigchld_stamp;
 
-int get_deet_id(pid_t pid) {
-    for (int i = 0; i < process_count; i++) {
-        if (process_table[i].pid == pid) {
-            return process_table[i].deet_id;
+void (*state_change_hook)(int deet_id, PSTATE old, PSTATE new);
+
+ProcessStore ptable = {
+    .state_head = { [0 ... NUM_PSTATES - 1] = -1 }
+};
+
+static const char *pstate_names[] = {
+    [PSTATE_NONE] = "none",
+    [PSTATE_RUNNING] = "running",
+    [PSTATE_STOPPING] = "stopping",
+    [PSTATE_STOPPED] = "stopped",
+    [PSTATE_CONTINUING] = "continuing",
+    [PSTATE_KILLED] = "killed",
+    [PSTATE_DEAD] = "dead"
+};
+
+static void state_link(int id, PSTATE state) {
+    int head = ptable.state_head[state];
+    ptable.state_prev[id] = -1;
+    ptable.state_next[id] = head;
+    if (head != -1) ptable.state_prev[head] = id;
+    ptable.state_head[state] = id;
+    ptable.state_count[state]++;
+}
+
+static void state_unlink(int id, PSTATE state) {
+    int prev = ptable.state_prev[id], next = ptable.state_next[id];
+    if (prev != -1) ptable.state_next[prev] = next;
+    else ptable.state_head[state] = next;
+    if (next != -1) ptable.state_prev[next] = prev;
+    ptable.state_count[state]--;
+}
+
+// FNV-1a over a process's NUL-separated argument strings
+static uint32_t args_hash(const char *args, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)args[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * The interned slot for the given argument strings: the one holding a
+ * process with the same ones, or else the empty one to put them in.
+ */
+static int intern_slot(const char *args, size_t len) {
+    int mask = ptable.interned_size - 1;
+    int slot = args_hash(args, len) & mask;
+    for (int id; (id = ptable.interned[slot]) != -1; slot = (slot + 1) & mask) {
+        // The command line is stored right after the arguments
+        if (ptable.command_line[id] - ptable.argv[id] == len &&
+            memcmp(arena_at(&ptable.strings, ptable.argv[id]), args, len) == 0) break;
+    }
+    return slot;
+}
+
+static void intern(int id) {
+    size_t len = ptable.command_line[id] - ptable.argv[id];
+    int slot = intern_slot(arena_at(&ptable.strings, ptable.argv[id]), len);
+    if (ptable.interned[slot] == -1) ptable.interned[slot] = id;
+}
+
+static int ptable_grow(void) {
+    int capacity = ptable.capacity ? ptable.capacity * 2 : 128;
+#define GROW(field)                                                            \
+    do {                                                                       \
+        void *p = realloc(ptable.field, capacity * sizeof(*ptable.field));     \
+        if (p == NULL) return -1;                                              \
+        ptable.field = p;                                                      \
+    } while (0)
+    GROW(pid);
+    GROW(state);
+    GROW(traced);
+    GROW(seized);
+    GROW(state_next);
+    GROW(state_prev);
+    GROW(argc);
+    GROW(argv);
+    GROW(command_line);
+    GROW(started);
+    GROW(changed);
+    GROW(group);
+    GROW(child);
+#undef GROW
+
+    // Keep the interned table at most half full
+    int *interned = malloc(2 * capacity * sizeof(int));
+    if (interned == NULL) return -1;
+    ptable.capacity = capacity;
+    free(ptable.interned);
+    ptable.interned = interned;
+    ptable.interned_size = 2 * capacity;
+    memset(ptable.interned, -1, ptable.interned_size * sizeof(int));
+    for (int id = 0; id < ptable.count; id++) intern(id);
+    return 0;
+}
+
+/*
+ * Add a process and return its deet ID, or -1 if it cannot be stored.
+ * The argument strings are copied into the arena, unless an earlier
+ * process had the same ones, so argv may be transient.  SIGCHLD is held
+ * off while the arrays may move.
+ */
+int ptable_add(pid_t pid, int argc, char **argv) {
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    int id = -1;
+    if (ptable.count == ptable.capacity && ptable_grow() == -1) goto out;
+
+    size_t args = ptable.strings.used;
+    for (int i = 0; i < argc; i++) {
+        if (arena_append_str(&ptable.strings, argv[i]) == ARENA_NONE) goto out;
+    }
+    size_t cmd = ptable.strings.used;
+    int slot = intern_slot(arena_at(&ptable.strings, args), cmd - args);
+    int same = ptable.interned[slot];
+    if (same != -1) {
+        // Take back the copy just made and share the earlier one
+        ptable.strings.used = args;
+        args = ptable.argv[same];
+        cmd = ptable.command_line[same];
+    } else {
+        for (int i = 0; i < argc; i++) {
+            if (arena_append(&ptable.strings, argv[i], strlen(argv[i])) == ARENA_NONE) goto out;
+            if (arena_append(&ptable.strings, i + 1 < argc ? " " : "", 1) == ARENA_NONE) goto out;
         }
+        if (argc == 0 && arena_append_str(&ptable.strings, "") == ARENA_NONE) goto out;
     }
-    return -1; // PID not found
+
+    id = ptable.count++;
+    ptable.pid[id] = pid;
+    ptable.state[id] = PSTATE_RUNNING;
+    state_link(id, PSTATE_RUNNING);
+    ptable.traced[id] = true;
+    ptable.seized[id] = false;
+    ptable.argc[id] = argc;
+    ptable.argv[id] = args;
+    ptable.command_line[id] = cmd;
+    clock_gettime(CLOCK_REALTIME, &ptable.started[id]);
+    ptable.changed[id] = ptable.started[id];
+    ptable.group[id] = -1;
+    ptable.child[id] = true;
+    if (same == -1) ptable.interned[slot] = id;
+    statefile_sync(id);
+out:
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return id;
 }
 
-const char* get_command_line(pid_t pid) {
-    for (int i = 0; i < process_count; i++) {
-        if (process_table[i].pid == pid) {
-            return process_table[i].command_line;
+/*
+ * The most recent entry for pid, since a PID may have been reused.
+ */
+int ptable_find(pid_t pid) {
+    for (int i = ptable.count - 1; i >= 0; i--) {
+        if (ptable.pid[i] == pid) {
+            return i;
         }
     }
-    return ""; // PID not found
+    return -1; // PID not found
+}
+
+void ptable_set_state(int deet_id, PSTATE new_state) {
+    PSTATE old_state = ptable.state[deet_id];
+    if (old_state != new_state) {
+        state_unlink(deet_id, old_state);
+        state_link(deet_id, new_state);
+    }
+    ptable.state[deet_id] = new_state;
+    clock_gettime(CLOCK_REALTIME, &ptable.changed[deet_id]);
+    statefile_sync(deet_id);
+    if (state_change_hook != NULL && old_state != new_state) {
+        state_change_hook(deet_id, old_state, new_state);
+    }
+}
+
+/*
+ * Forget every process.  The arena and arrays are kept for reuse.
+ */
+void ptable_clear(void) {
+    ptable.count = 0;
+    ptable.strings.used = 0;
+    if (ptable.interned != NULL) memset(ptable.interned, -1, ptable.interned_size * sizeof(int));
+    for (int s = 0; s < NUM_PSTATES; s++) {
+        ptable.state_head[s] = -1;
+        ptable.state_count[s] = 0;
+    }
+}
+
+const char *ptable_command_line(int deet_id) {
+    return arena_at(&ptable.strings, ptable.command_line[deet_id]);
+}
+
+const char *ptable_arg(int deet_id, int n) {
+    if (n < 0 || n >= ptable.argc[deet_id]) return NULL;
+    const char *arg = arena_at(&ptable.strings, ptable.argv[deet_id]);
+    while (n-- > 0) arg += strlen(arg) + 1;
+    return arg;
+}
+
+const char *pstate_name(PSTATE state) {
+    if ((int)state < 0 || (int)state >= NUM_PSTATES) return "unknown";
+    return pstate_names[state];
+}
+
+int pstate_parse(const char *name) {
+    for (int i = 0; i < NUM_PSTATES; i++) {
+        if (strcmp(pstate_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+int get_deet_id(pid_t pid) {
+    return ptable_find(pid);
+}
+
+const char* get_command_line(pid_t pid) {
+    int id = ptable_find(pid);
+    if (id == -1) return ""; // PID not found
+    return ptable_command_line(id);
 }
 
 void sigint_handler(int sig) {
@@ -41,29 +255,55 @@ void sigint_handler(int sig) {
     log_shutdown();
 }
 
+// Time the table update from the SIGCHLD that reported it, if there was one
+static void state_updated(void) {
+    if (sigchld_stamp != 0) STATS_SINCE(HIST_STATE_UPDATE, sigchld_stamp);
+}
+
+/*
+ * Apply one status reported by waitpid() to the process table.
+ */
+void handle_wait_status(pid_t pid, int status) {
+    int i = ptable_find(pid);
+    if (i == -1) {
+        cover_stray(pid, status);
+        return;
+    }
+    if (WIFSTOPPED(status)) {
+        // A seized process only really stops for group stops and interrupts
+        if (ptable.seized[i] && (cover_trap(i, status) || trace_pass_signal(i, status))) return;
+        PSTATE old = ptable.state[i];
+        ptable_set_state(i, PSTATE_STOPPED);
+        state_updated();
+        STATS_INC(CNT_STOPPED);
+        if (old != PSTATE_STOPPED) {
+            log_state_change(pid, old, PSTATE_STOPPED, WSTOPSIG(status));
+        }
+    } else if (WIFCONTINUED(status)) {
+        // cont has already recorded the continue it sent
+        bool changed = ptable.state[i] == PSTATE_STOPPED;
+        if (changed) ptable_set_state(i, PSTATE_RUNNING);
+        state_updated();
+        STATS_INC(CNT_CONTINUED);
+        if (changed) log_state_change(pid, PSTATE_STOPPED, PSTATE_RUNNING, 0);
+    } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        PSTATE old = ptable.state[i] == PSTATE_KILLED ? PSTATE_KILLED : PSTATE_RUNNING;
+        ptable.seized[i] = false;
+        cover_exit(i);
+        capture_exit(i);
+        ptable_set_state(i, PSTATE_DEAD);
+        state_updated();
+        STATS_INC(CNT_EXITED);
+        log_state_change(pid, old, PSTATE_DEAD, WTERMSIG(status));
+    }
+}
+
 void handle_sigchld() {
     int status;
     pid_t pid;
 
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        for (int i = 0; i < process_count; i++) {
-            if (process_table[i].pid == pid) {
-                if (WIFSTOPPED(status)) {
-                    process_table[i].state = PSTATE_STOPPED;
-                    log_state_change(pid, PSTATE_RUNNING, PSTATE_STOPPED, WSTOPSIG(status));
-                    //write("%d\t%d\tT\tstopped\t\t%s\n", process_table[i].deet_id, pid, process_table[i].command_line);
-                } else if (WIFCONTINUED(status)) {
-                    process_table[i].state = PSTATE_RUNNING;
-                    log_state_change(pid, PSTATE_STOPPED, PSTATE_RUNNING, 0);
-                } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                    process_table[i].state = PSTATE_DEAD;
-                    log_state_change(pid, PSTATE_RUNNING, PSTATE_DEAD, WTERMSIG(status));
-                    // Remove the process from the process table
-                    // ... (code to remove process from process_table)
-                }
-                break;
-            }
-        }
+        handle_wait_status(pid, status);
     }
 
     // Reset the flag
@@ -74,11 +314,60 @@ void handle_sigchld() {
     // fflush(stdout);
 }
 
-void sigchld_handler(int sig) {
-    sigchld_received = 1;
+/*
+ * When deet quits, kill every traced process it started and wait for each
+ * to die.  Released processes are left running, and processes deet only
+ * attached to are detached instead, as they were before it came along.
+ */
+void ptable_kill_all(void) {
+    for (int i = 0; i < ptable.count; i++) {
+        if (ptable.state[i] == PSTATE_DEAD || !ptable.traced[i]) continue;
+        if (!ptable.child[i]) {
+            if (trace_release(i) == -1) warn("Cannot detach from process %d", (int)ptable.pid[i]);
+            continue;
+        }
+        pid_t pid = ptable.pid[i];
+        log_state_change(pid, ptable.state[i], PSTATE_KILLED, 0);
+        ptable_set_state(i, PSTATE_KILLED);
+        int rc;
+        // SIGKILL also ends stopped and frozen processes
+        STATS_TIMED(HIST_SIGNAL, rc = kill(pid, SIGKILL));
+        if (rc == -1) continue;
+        int status;
+        while (ptable.state[i] != PSTATE_DEAD) {
+            if (waitpid(pid, &status, __WALL) == -1) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                sigchld_arrived();
+                sigchld_log(SIGCHLD);
+            }
+            handle_wait_status(pid, status);
+        }
+        sigchld_stamp = 0;
+    }
+}
 
-    // Log the signal reception
+/*
+ * Bookkeeping for a SIGCHLD, whether it arrived through the handler or
+ * was read from a signalfd: every one is counted, and stamped so that the
+ * table update it leads to can be timed.  Logging it is a separate
+ * decision, made by sigchld_log()'s callers.
+ */
+void sigchld_arrived(void) {
+    sigchld_stamp = stats_clock();
+    STATS_INC(CNT_SIGCHLD);
+}
+
+void sigchld_log(int sig) {
     log_signal(sig);
+}
+
+void sigchld_handler(int sig) {
+    sigchld_received = 1;
+    sigchld_arrived();
+    sigchld_log(sig);
 
     // Temporarily unblock SIGCHLD for waitpid
     sigset_t mask, oldmask;
@@ -93,20 +382,76 @@ void sigchld_handler(int sig) {
     sigprocmask(SIG_SETMASK, &oldmask, NULL);
 }
 
-void update_process_state(pid_t pid, PSTATE new_state) {
-    for (int i = 0; i < process_count; i++) {
-        if (process_table[i].pid == pid) {
-            process_table[i].state = new_state;
-            break;
+/*
+ * Block SIGCHLD and return a signalfd for it, so child state changes are
+ * handled from the event loop rather than in signal context.
+ */
+int sigchld_fd_open(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) return -1;
+    return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+/*
+ * Whether a plain stop or continue only confirms the state that deet set
+ * in the table when it sent the signal itself.
+ */
+static bool status_expected(pid_t pid, int status) {
+    int i = ptable_find(pid);
+    if (i == -1 || ptable.seized[i]) return false;
+    return (WIFSTOPPED(status) && ptable.state[i] == PSTATE_STOPPED) ||
+           (WIFCONTINUED(status) && (ptable.state[i] == PSTATE_RUNNING || ptable.state[i] == PSTATE_CONTINUING));
+}
+
+/*
+ * Event loop handler for the descriptor from sigchld_fd_open().  A
+ * signalfd also receives the SIGCHLDs for plain stops and continues that
+ * the handler, installed with SA_NOCLDSTOP, never saw; those are not
+ * logged, so the log reads as it always has.  Only one SIGCHLD is pending
+ * at a time, so an exit can arrive folded into a continue's: the signal
+ * is also logged whenever waitpid() has something to report, other than
+ * the stops and continues that deet caused.  A process that stops or
+ * continues on its own is still followed, for wait <id> stopped.
+ */
+void sigchld_fd_event(int fd, short revents, void *data) {
+    struct signalfd_siginfo si;
+    bool any = false, logged = false;
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+        any = true;
+        sigchld_arrived();
+        if (!logged && (si.ssi_code == CLD_EXITED || si.ssi_code == CLD_KILLED ||
+                        si.ssi_code == CLD_DUMPED || si.ssi_code == CLD_TRAPPED)) {
+            sigchld_log(si.ssi_signo);
+            logged = true;
         }
     }
+    if (!any) return;
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        if (!logged && !status_expected(pid, status)) {
+            sigchld_log(SIGCHLD);
+            logged = true;
+        }
+        handle_wait_status(pid, status);
+    }
+    sigchld_stamp = 0;
+    sigchld_received = 0;
+}
+
+void update_process_state(pid_t pid, PSTATE new_state) {
+    int i = ptable_find(pid);
+    if (i != -1) {
+        ptable_set_state(i, new_state);
+    }
 }
 
 pid_t get_pid(int deet_id) {
-    for (int i = 0; i < process_count; i++) {
-        if (process_table[i].deet_id == deet_id) {
-            return process_table[i].pid;
-        }
+    if (deet_id < 0 || deet_id >= ptable.count) {
+        return -1; // Deet ID not found
     }
-    return -1; // Deet ID not found
+    return ptable.pid[deet_id];
 }
\ No newline at end of file
@@ -0,0 +1,214 @@
+#include <stdbool.h>
+#include "insn.h"
+
+#define INSN_MAX_LEN 15
+
+// Immediate sizes other than a plain byte count
+#define IMM_Z -1 // 2 bytes with an operand size prefix, 4 otherwise
+#define IMM_V -2 // As IMM_Z, but 8 bytes with REX.W
+#define IMM_A -3 // A full address: 4 bytes with an address size prefix, 8 otherwise
+
+typedef struct {
+    bool modrm;
+    int imm;
+    bool invalid;
+} OpInfo;
+
+static bool is_legacy_prefix(uint8_t b) {
+    return b == 0x66 || b == 0x67 || b == 0xf0 || b == 0xf2 || b == 0xf3 ||
+           b == 0x2e || b == 0x36 || b == 0x3e || b == 0x26 || b == 0x64 || b == 0x65;
+}
+
+// One-byte opcodes, other than the prefixes and escapes handled by the caller
+static OpInfo one_byte(uint8_t op, INSN_KIND *kind) {
+    OpInfo info = { false, 0, false };
+    if (op < 0x40) {
+        // The ALU block: r/m forms, then AL and eAX with an immediate
+        int low = op & 7;
+        if (low >= 6) info.invalid = true;
+        info.modrm = low < 4;
+        info.imm = low == 4 ? 1 : low == 5 ? IMM_Z : 0;
+    } else if (op < 0x60) {
+        // push and pop of a register; 40-4f are REX, not allowed twice
+        info.invalid = op < 0x50;
+    } else if (op == 0x63 || (op >= 0x84 && op <= 0x8f) || (op >= 0xd0 && op <= 0xd3) ||
+               (op >= 0xd8 && op <= 0xdf) || op == 0xfe || op == 0xff) {
+        info.modrm = true;
+    } else if (op == 0x68 || op == 0xa9) {
+        info.imm = IMM_Z;
+    } else if (op == 0x69 || op == 0x81 || op == 0xc7) {
+        info.modrm = true;
+        info.imm = IMM_Z;
+    } else if (op == 0x6a || op == 0xa8 || op == 0xcd || (op >= 0xe4 && op <= 0xe7) || (op >= 0xb0 && op <= 0xb7)) {
+        info.imm = 1;
+    } else if (op == 0x6b || op == 0x80 || op == 0x83 || op == 0xc0 || op == 0xc1 || op == 0xc6) {
+        info.modrm = true;
+        info.imm = 1;
+    } else if ((op >= 0x70 && op <= 0x7f) || (op >= 0xe0 && op <= 0xe3)) {
+        *kind = INSN_JCC;
+        info.imm = 1;
+    } else if (op >= 0xa0 && op <= 0xa3) {
+        info.imm = IMM_A;
+    } else if (op >= 0xb8 && op <= 0xbf) {
+        info.imm = IMM_V;
+    } else if (op == 0xc2 || op == 0xca) {
+        *kind = INSN_STOP;
+        info.imm = 2;
+    } else if (op == 0xc3 || op == 0xcb || op == 0xcc || op == 0xcf || op == 0xf4) {
+        *kind = INSN_STOP;
+    } else if (op == 0xc8) {
+        info.imm = 3;
+    } else if (op == 0xe8) {
+        *kind = INSN_CALL;
+        info.imm = 4;
+    } else if (op == 0xe9) {
+        *kind = INSN_JMP;
+        info.imm = 4;
+    } else if (op == 0xeb) {
+        *kind = INSN_JMP;
+        info.imm = 1;
+    } else if (op == 0x60 || op == 0x61 || op == 0x82 || op == 0x9a || op == 0xce ||
+               (op >= 0xd4 && op <= 0xd6) || op == 0xea) {
+        info.invalid = true;
+    } else if (op == 0xf6 || op == 0xf7) {
+        // The immediate, for test only, depends on the ModRM reg field
+        info.modrm = true;
+    }
+    // Everything else (6c-6f, 90-9f, a4-af, c9, d7, ec-ef, f1, f5, f8-fd) is bare
+    return info;
+}
+
+// Opcodes after 0f
+static OpInfo two_byte(uint8_t op, INSN_KIND *kind) {
+    OpInfo info = { true, 0, false };
+    if (op == 0x04 || op == 0x0a || op == 0x0c || (op >= 0x24 && op <= 0x27) ||
+        op == 0x39 || (op >= 0x3b && op <= 0x3f) || op == 0x7a || op == 0x7b || op == 0xa6 || op == 0xa7) {
+        info.invalid = true;
+    } else if (op == 0x0b) {
+        *kind = INSN_STOP; // ud2
+        info.modrm = false;
+    } else if ((op >= 0x05 && op <= 0x09) || op == 0x0e || (op >= 0x30 && op <= 0x37) || op == 0x77 ||
+               op == 0xa0 || op == 0xa1 || op == 0xa2 || (op >= 0xa8 && op <= 0xaa) || (op >= 0xc8 && op <= 0xcf)) {
+        info.modrm = false;
+    } else if (op >= 0x80 && op <= 0x8f) {
+        *kind = INSN_JCC;
+        info.modrm = false;
+        info.imm = 4;
+    } else if (op == 0x0f || (op >= 0x70 && op <= 0x73) || op == 0xa4 || op == 0xac || op == 0xba ||
+               op == 0xc2 || (op >= 0xc4 && op <= 0xc6)) {
+        info.imm = 1;
+    }
+    return info;
+}
+
+// VEX and EVEX opcodes, in the map given by their prefix
+static OpInfo vex_op(int map, uint8_t op) {
+    OpInfo info = { true, 0, false };
+    if (map == 1) {
+        if (op == 0x77) info.modrm = false; // vzeroupper, vzeroall
+        if ((op >= 0x70 && op <= 0x73) || op == 0xc2 || (op >= 0xc4 && op <= 0xc6)) info.imm = 1;
+    } else if (map == 3) {
+        info.imm = 1;
+    } else if (map != 2) {
+        info.invalid = true;
+    }
+    return info;
+}
+
+/*
+ * Decode the instruction at the start of code, of which avail bytes are
+ * readable.  Returns its length, or -1 if it is not one this decoder
+ * knows or does not fit.
+ */
+int insn_decode(const uint8_t *code, size_t avail, Insn *insn) {
+    size_t i = 0;
+    bool opsize16 = false, addr32 = false, rexw = false;
+    if (avail > INSN_MAX_LEN) avail = INSN_MAX_LEN;
+#define NEED(n) do { if (i + (n) > avail) return -1; } while (0)
+
+    NEED(1);
+    while (is_legacy_prefix(code[i])) {
+        if (code[i] == 0x66) opsize16 = true;
+        if (code[i] == 0x67) addr32 = true;
+        i++;
+        NEED(1);
+    }
+    if ((code[i] & 0xf0) == 0x40) {
+        rexw = code[i] & 0x08;
+        i++;
+        NEED(1);
+    }
+
+    INSN_KIND kind = INSN_OTHER;
+    OpInfo info;
+    bool one = false; // A one-byte opcode, rather than one from another map
+    uint8_t op = code[i++];
+    if (op == 0x0f) {
+        NEED(1);
+        op = code[i++];
+        if (op == 0x38 || op == 0x3a) {
+            NEED(1);
+            i++;
+            info = (OpInfo){ true, op == 0x3a ? 1 : 0, false };
+        } else {
+            info = two_byte(op, &kind);
+        }
+    } else if (op == 0xc4 || op == 0xc5 || op == 0x62) {
+        // VEX and EVEX: the prefix names the opcode map, and REX.W is inside it
+        int map = 1, len = op == 0xc5 ? 1 : op == 0xc4 ? 2 : 3;
+        NEED(len + 1);
+        if (op != 0xc5) map = code[i] & (op == 0x62 ? 0x07 : 0x1f);
+        i += len;
+        info = vex_op(map, code[i++]);
+    } else if (op == 0x8f) {
+        NEED(1);
+        // pop r/m has a zero reg field; anything else is an XOP prefix
+        if (code[i] & 0x38) return -1;
+        info = one_byte(op, &kind);
+        one = true;
+    } else {
+        info = one_byte(op, &kind);
+        one = true;
+    }
+    if (info.invalid) return -1;
+
+    if (info.modrm) {
+        NEED(1);
+        uint8_t modrm = code[i++];
+        int mod = modrm >> 6, reg = (modrm >> 3) & 7, rm = modrm & 7;
+        int disp = 0;
+        if (mod != 3) {
+            int base = rm;
+            if (rm == 4) {
+                NEED(1);
+                base = code[i++] & 7;
+            }
+            if (mod == 1) disp = 1;
+            else if (mod == 2 || base == 5) disp = 4;
+        }
+        i += disp;
+        if (one && (op == 0xf6 || op == 0xf7) && reg < 2) info.imm = op == 0xf6 ? 1 : IMM_Z;
+        // ff /2 and /3 are indirect calls, /4 and /5 indirect jumps
+        if (one && op == 0xff && (reg == 4 || reg == 5)) kind = INSN_STOP;
+    }
+
+    int imm = info.imm;
+    if (imm == IMM_Z) imm = opsize16 ? 2 : 4;
+    else if (imm == IMM_V) imm = rexw ? 8 : opsize16 ? 2 : 4;
+    else if (imm == IMM_A) imm = addr32 ? 4 : 8;
+    NEED(imm);
+    size_t at = i;
+    i += imm;
+#undef NEED
+
+    insn->len = i;
+    insn->kind = kind;
+    insn->target = 0;
+    if (kind == INSN_CALL || kind == INSN_JCC || kind == INSN_JMP) {
+        int64_t rel = imm == 1 ? (int8_t)code[at] :
+                      (int32_t)((uint32_t)code[at] | (uint32_t)code[at + 1] << 8 |
+                                (uint32_t)code[at + 2] << 16 | (uint32_t)code[at + 3] << 24);
+        insn->target = (int64_t)i + rel;
+    }
+    return i;
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "deet.h"
 #include "deet_run.h"
@@ -8,7 +9,20 @@ int main(int argc, char *argv[]) {
 
     silent_logging = 0;
 
-    run_deet(silent_logging);
+    const char *listen_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_path = argv[++i];
+        } else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc) {
+            deet_state_path = argv[++i];
+        }
+    }
+
+    if (listen_path != NULL) {
+        run_deet_server(listen_path);
+    } else {
+        run_deet(silent_logging);
+    }
 
     return 0;
 }
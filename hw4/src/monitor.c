@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include "monitor.h"
+#include "helper.h"
+#include "evloop.h"
+#include "stats.h"
+#include "debug.h"
+
+typedef struct {
+    uint64_t time_ns; // CLOCK_REALTIME
+    uint16_t range;
+    uint16_t len;
+    uint8_t data[MONITOR_MAX_LEN];
+} MonitorSample;
+
+typedef struct {
+    int deet_id;
+    int timer_fd; // -1 once sampling has stopped
+    int hz;
+    int nranges;
+    struct iovec local[MONITOR_MAX_RANGES];
+    struct iovec remote[MONITOR_MAX_RANGES];
+    uint8_t cur[MONITOR_MAX_RANGES][MONITOR_MAX_LEN];
+    uint8_t prev[MONITOR_MAX_RANGES][MONITOR_MAX_LEN];
+    bool seen[MONITOR_MAX_RANGES]; // prev holds a sample
+    uint64_t ticks; // Samples taken
+    uint64_t missed; // Timer expirations that did not get a sample
+    uint64_t failed; // Samples that could not read every range
+    uint64_t changes; // Samples recorded, including ones since overwritten
+    MonitorSample ring[MONITOR_RING];
+} Monitor;
+
+static Monitor **monitors; // Indexed by deet ID
+static int monitors_size;
+
+static Monitor *monitor_get(int deet_id) {
+    if (deet_id < 0 || deet_id >= monitors_size) return NULL;
+    return monitors[deet_id];
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record(Monitor *m, int range, uint64_t now) {
+    MonitorSample *s = &m->ring[m->changes++ % MONITOR_RING];
+    s->time_ns = now;
+    s->range = range;
+    s->len = m->local[range].iov_len;
+    memcpy(s->data, m->cur[range], s->len);
+}
+
+/*
+ * Take one sample of every range.  Ranges are read in order, so after a
+ * short read the ones that were fully read are still compared.  Returns
+ * -1 if the process is gone.
+ */
+static int sample(Monitor *m) {
+    pid_t pid = ptable.pid[m->deet_id];
+    ssize_t n;
+    STATS_TIMED(HIST_PROCESS_VM, n = process_vm_readv(pid, m->local, m->nranges, m->remote, m->nranges, 0));
+    if (n == -1) {
+        m->failed++;
+        return errno == ESRCH ? -1 : 0;
+    }
+    m->ticks++;
+    uint64_t now = realtime_ns();
+    size_t done = n;
+    for (int r = 0; r < m->nranges; r++) {
+        size_t len = m->local[r].iov_len;
+        if (done < len) {
+            m->failed++;
+            break;
+        }
+        done -= len;
+        if (m->seen[r] && memcmp(m->cur[r], m->prev[r], len) == 0) continue;
+        memcpy(m->prev[r], m->cur[r], len);
+        m->seen[r] = true;
+        record(m, r, now);
+    }
+    return 0;
+}
+
+static void monitor_close(Monitor *m) {
+    if (m->timer_fd == -1) return;
+    ev_remove(m->timer_fd);
+    close(m->timer_fd);
+    m->timer_fd = -1;
+}
+
+static void monitor_event(int fd, short revents, void *data) {
+    Monitor *m = data;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    if (expirations > 1) m->missed += expirations - 1;
+    if (sample(m) == -1 || ptable.state[m->deet_id] == PSTATE_DEAD) monitor_close(m);
+}
+
+static int set_rate(Monitor *m, int hz) {
+    struct itimerspec its;
+    its.it_interval.tv_sec = hz == 1 ? 1 : 0;
+    its.it_interval.tv_nsec = hz == 1 ? 0 : 1000000000L / hz;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(m->timer_fd, 0, &its, NULL) == -1) return -1;
+    m->hz = hz;
+    return 0;
+}
+
+/*
+ * Start sampling [addr, addr + len) of deet_id at hz, adding to the
+ * ranges already monitored for it (all of which then use hz).  The
+ * range is read once right away, so an unreadable one is refused.
+ */
+int monitor_add(int deet_id, uintptr_t addr, size_t len, int hz) {
+    if (len == 0 || len > MONITOR_MAX_LEN || hz < 1 || hz > MONITOR_MAX_HZ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (deet_id >= monitors_size) {
+        int size = monitors_size ? monitors_size : 16;
+        while (size <= deet_id) size *= 2;
+        Monitor **p = realloc(monitors, size * sizeof(Monitor *));
+        if (p == NULL) return -1;
+        memset(p + monitors_size, 0, (size - monitors_size) * sizeof(Monitor *));
+        monitors = p;
+        monitors_size = size;
+    }
+
+    Monitor *m = monitors[deet_id];
+    if (m == NULL) {
+        if ((m = calloc(1, sizeof(Monitor))) == NULL) return -1;
+        m->deet_id = deet_id;
+        m->timer_fd = -1;
+        monitors[deet_id] = m;
+    }
+    if (m->nranges == MONITOR_MAX_RANGES) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    // Check the new range on its own before sampling it with the others
+    int r = m->nranges;
+    struct iovec local = { m->cur[r], len };
+    struct iovec remote = { (void *)addr, len };
+    ssize_t n;
+    STATS_TIMED(HIST_PROCESS_VM, n = process_vm_readv(ptable.pid[deet_id], &local, 1, &remote, 1, 0));
+    if (n != (ssize_t)len) {
+        if (n >= 0) errno = EFAULT;
+        return -1;
+    }
+
+    bool armed = m->timer_fd != -1;
+    if (!armed) {
+        if ((m->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) return -1;
+        if (ev_add(m->timer_fd, POLLIN, monitor_event, m) == -1) {
+            close(m->timer_fd);
+            m->timer_fd = -1;
+            return -1;
+        }
+    }
+    // Only take the range once the timer runs at its rate: a refused one
+    // leaves the others sampled as before
+    if ((!armed || m->hz != hz) && set_rate(m, hz) == -1) {
+        if (!armed) monitor_close(m);
+        return -1;
+    }
+    m->local[r] = local;
+    m->remote[r] = remote;
+    m->nranges++;
+    memcpy(m->prev[r], m->cur[r], len);
+    m->seen[r] = true;
+    record(m, r, realtime_ns());
+    return 0;
+}
+
+int monitor_stop(int deet_id) {
+    Monitor *m = monitor_get(deet_id);
+    if (m == NULL) return -1;
+    monitor_close(m);
+    return 0;
+}
+
+// Print a sample's value: as a little-endian integer if it fits one
+static void format_value(StrBuf *out, const MonitorSample *s) {
+    if (s->len <= 8) {
+        unsigned long long v = 0;
+        for (int i = s->len - 1; i >= 0; i--) v = v << 8 | s->data[i];
+        sb_printf(out, "0x%llx", v);
+        return;
+    }
+    for (int i = 0; i < s->len; i++) sb_printf(out, "%02x", s->data[i]);
+}
+
+/*
+ * Summary line, then one line per recorded change, oldest first.
+ */
+int monitor_print(int deet_id, StrBuf *out) {
+    Monitor *m = monitor_get(deet_id);
+    if (m == NULL) return -1;
+    sb_printf(out, "%d ranges, %d Hz, %s: %llu samples, %llu missed, %llu failed, %llu changes\n",
+              m->nranges, m->hz, m->timer_fd != -1 ? "running" : "stopped",
+              (unsigned long long)m->ticks, (unsigned long long)m->missed,
+              (unsigned long long)m->failed, (unsigned long long)m->changes);
+    uint64_t first = m->changes > MONITOR_RING ? m->changes - MONITOR_RING : 0;
+    for (uint64_t i = first; i < m->changes; i++) {
+        MonitorSample *s = &m->ring[i % MONITOR_RING];
+        sb_printf(out, "%llu.%09llu\t%p\t", (unsigned long long)(s->time_ns / 1000000000ull),
+                  (unsigned long long)(s->time_ns % 1000000000ull), m->remote[s->range].iov_base);
+        format_value(out, s);
+        sb_printf(out, "\n");
+    }
+    return 0;
+}
+
+/*
+ * Write the recorded changes as CSV.  Values are hex bytes in memory
+ * order.
+ */
+int monitor_export(int deet_id, const char *path) {
+    Monitor *m = monitor_get(deet_id);
+    if (m == NULL) return -1;
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return -1;
+    fprintf(f, "time_ns,address,length,bytes\n");
+    uint64_t first = m->changes > MONITOR_RING ? m->changes - MONITOR_RING : 0;
+    for (uint64_t i = first; i < m->changes; i++) {
+        MonitorSample *s = &m->ring[i % MONITOR_RING];
+        fprintf(f, "%llu,%p,%d,", (unsigned long long)s->time_ns, m->remote[s->range].iov_base, s->len);
+        for (int b = 0; b < s->len; b++) fprintf(f, "%02x", s->data[b]);
+        fprintf(f, "\n");
+    }
+    int err = ferror(f);
+    if (fclose(f) != 0 || err) return -1;
+    return 0;
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "helper.h"
+#include "debug.h"
+#include "deet.h"
+#include "deet_run.h"
+#include "evloop.h"
+#include "stats.h"
+#include "strbuf.h"
+#include "trace.h"
+#include "statefile.h"
+#include "cgroup.h"
+
+/*
+ * Headless mode: the command set served over a Unix domain socket.
+ *
+ * Requests are single lines, "<tag> <command> [args...]\n", where tag is
+ * any token chosen by the client.  Clients may send any number of
+ * requests without waiting; they are executed in order and each is
+ * answered with a frame
+ *
+ *     <tag> ok|err <length>\n<length bytes of command output>
+ *
+ * A request that waits (wait <id> [state]) holds back the requests queued
+ * behind it on that connection only.  After "subscribe", state changes are
+ * pushed asynchronously as
+ *
+ *     * <length>\nCHANGE <id> <pid> <old> <new>\n
+ *
+ * Besides the usual commands, clients may send subscribe, unsubscribe,
+ * quit (close this connection) and shutdown (stop the server).
+ */
+
+#define MAX_REQUEST_BUFFER (1 << 20)
+#define READ_CHUNK 4096
+
+typedef struct client {
+    int fd;
+    StrBuf in; // Received bytes not yet executed
+    StrBuf out; // Frames not yet written
+    size_t out_off;
+    bool subscribed;
+    bool waiting; // Blocked on a wait request
+    WaitTarget wait;
+    char *wait_tag;
+    bool closing; // Close once out has drained
+    struct client *next;
+} Client;
+
+static Client *clients;
+static int listen_fd = -1;
+static bool running;
+
+static void client_process(Client *c);
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) return -1;
+    return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static void client_free(Client *c) {
+    for (Client **p = &clients; *p != NULL; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    ev_remove(c->fd);
+    close(c->fd);
+    sb_free(&c->in);
+    sb_free(&c->out);
+    free(c->wait_tag);
+    free(c);
+}
+
+/*
+ * Write as much pending output as the socket takes.  Returns -1 if the
+ * client has gone away and was freed.
+ */
+static int client_flush(Client *c) {
+    while (c->out_off < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out_off, c->out.len - c->out_off, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            client_free(c);
+            return -1;
+        }
+        c->out_off += n;
+    }
+    if (c->out_off == c->out.len) {
+        sb_clear(&c->out);
+        c->out_off = 0;
+        if (c->closing) {
+            client_free(c);
+            return -1;
+        }
+    }
+    ev_set_events(c->fd, POLLIN | (c->out.len ? POLLOUT : 0));
+    return 0;
+}
+
+static void frame(Client *c, const char *tag, int result, StrBuf *body) {
+    sb_printf(&c->out, "%s %s %zu\n", tag, result == CMD_ERROR ? "err" : "ok", body->len);
+    sb_append(&c->out, body->data, body->len);
+}
+
+/*
+ * Execute one request line.  Returns false if the client must stop
+ * processing further input for now.
+ */
+static bool client_request(Client *c, char *line) {
+    static StrBuf body;
+    sb_clear(&body);
+
+    line[strcspn(line, "\r")] = 0;
+    char *tag = line;
+    char *cmd = strchr(line, ' ');
+    if (cmd != NULL) *cmd++ = 0;
+    if (*tag == 0) return true;
+    if (cmd == NULL) cmd = "";
+
+    int result = CMD_OK;
+    if (strcmp(cmd, "subscribe") == 0) {
+        c->subscribed = true;
+    } else if (strcmp(cmd, "unsubscribe") == 0) {
+        c->subscribed = false;
+    } else if (strcmp(cmd, "shutdown") == 0) {
+        running = false;
+    } else {
+        result = deet_command(cmd, &body, &c->wait);
+    }
+
+    if (result == CMD_WAIT) {
+        free(c->wait_tag);
+        if ((c->wait_tag = strdup(tag)) == NULL) {
+            frame(c, tag, CMD_ERROR, &body);
+            return true;
+        }
+        c->waiting = true;
+        return false;
+    }
+    if (result == CMD_QUIT) {
+        frame(c, tag, CMD_OK, &body);
+        c->closing = true;
+        return false;
+    }
+    frame(c, tag, result, &body);
+    return true;
+}
+
+/*
+ * Run every complete request buffered for c, stopping early at a wait.
+ */
+static void client_process(Client *c) {
+    size_t start = 0;
+    while (!c->waiting && !c->closing) {
+        char *nl = memchr(c->in.data + start, '\n', c->in.len - start);
+        if (nl == NULL) break;
+        *nl = 0;
+        char *line = c->in.data + start;
+        start = nl - c->in.data + 1;
+        if (!client_request(c, line)) break;
+    }
+    if (start > 0) {
+        memmove(c->in.data, c->in.data + start, c->in.len - start);
+        c->in.len -= start;
+    }
+    client_flush(c);
+}
+
+static void client_event(int fd, short revents, void *data) {
+    Client *c = data;
+    if (revents & POLLOUT) {
+        if (client_flush(c) == -1) return;
+    }
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        char buf[READ_CHUNK];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0 || c->in.len + n > MAX_REQUEST_BUFFER || sb_append(&c->in, buf, n) == -1) {
+            client_free(c);
+            return;
+        }
+        client_process(c);
+    }
+}
+
+static void accept_event(int fd, short revents, void *data) {
+    for (;;) {
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+            return;
+        }
+        Client *c = calloc(1, sizeof(Client));
+        if (c == NULL || set_nonblocking(cfd) == -1 || ev_add(cfd, POLLIN, client_event, c) == -1) {
+            close(cfd);
+            free(c);
+            continue;
+        }
+        c->fd = cfd;
+        c->next = clients;
+        clients = c;
+    }
+}
+
+/*
+ * Only queues notifications: this can run in the middle of a command, so
+ * waits are completed and output flushed later by service_clients().
+ */
+static void notify_state_change(int deet_id, PSTATE old, PSTATE new) {
+    char msg[128];
+    int len = snprintf(msg, sizeof(msg), "CHANGE %d %d %s %s\n", deet_id,
+                       (int)ptable.pid[deet_id], pstate_name(old), pstate_name(new));
+    for (Client *c = clients; c != NULL; c = c->next) {
+        if (c->subscribed) {
+            sb_printf(&c->out, "* %d\n", len);
+            sb_append(&c->out, msg, len);
+        }
+    }
+}
+
+/*
+ * After each pass of the event loop: answer waits that are now satisfied,
+ * resume the requests queued behind them, and push pending output.
+ */
+static void service_clients(void) {
+    Client *next;
+    for (Client *c = clients; c != NULL; c = next) {
+        next = c->next;
+        if (c->waiting && wait_satisfied(&c->wait)) {
+            StrBuf empty = {0};
+            c->waiting = false;
+            frame(c, c->wait_tag, CMD_OK, &empty);
+            client_process(c);
+        } else if (c->out.len > c->out_off) {
+            client_flush(c);
+        }
+    }
+}
+
+/*
+ * Whether addr names a socket nothing listens on any more, such as one
+ * left behind by a server that crashed.
+ */
+static bool stale_socket(const struct sockaddr_un *addr) {
+    struct stat st;
+    if (lstat(addr->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return false;
+    bool stale = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1 &&
+                 errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+/*
+ * Listen on path.  Only a stale socket is removed first: anything else
+ * there, including a live server's socket, makes bind() fail.
+ */
+static int open_listener(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) return -1;
+    if (stale_socket(&addr)) unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, SOMAXCONN) == -1 || set_nonblocking(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void run_deet_server(const char *path) {
+    // SIGCHLD is consumed through a signalfd by the event loop
+    int sfd = sigchld_fd_open();
+    if (sfd == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    if ((listen_fd = open_listener(path)) == -1) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (ev_add(sfd, POLLIN, sigchld_fd_event, NULL) == -1 ||
+        ev_add(listen_fd, POLLIN, accept_event, NULL) == -1) {
+        perror("ev_add");
+        exit(EXIT_FAILURE);
+    }
+    state_change_hook = notify_state_change;
+    deet_errors_to_output = true;
+
+    stats_init();
+    log_startup(); // Log startup
+    if (deet_state_path != NULL && trace_restore(deet_state_path) == -1) {
+        perror(deet_state_path);
+    }
+
+    running = true;
+    while (running) {
+        if (ev_poll(-1) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        service_clients();
+        stats_service();
+    }
+
+    while (clients != NULL) {
+        Client *c = clients;
+        if (client_flush(c) == 0) client_free(c);
+    }
+    state_change_hook = NULL;
+    trace_shutdown();
+    close(listen_fd);
+    statefile_close();
+    group_cleanup();
+    close(sfd);
+    unlink(path);
+    log_shutdown(); // Log shutdown
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "helper.h"
+#include "show.h"
+
+/*
+ * show [<id> | <lo>-<hi>] [state=<s>[,<s>...]] [traced | untraced]
+ *      [cmd=<substring>] [sort=id|pid|state|cmd]
+ *
+ * With a state filter only the membership lists of the requested states
+ * are walked; otherwise the hot arrays are scanned once.
+ *
+ * The third column is T for a traced process and U for an untraced one
+ * deet forked, whose exit it still sees.  One that is neither, attached
+ * or restored and then not traced, shows -: its state is the last deet
+ * knew, and is not followed.
+ */
+
+typedef enum { SORT_ID, SORT_PID, SORT_STATE, SORT_CMD } SORT_KEY;
+
+typedef struct {
+    unsigned states; // Bit per PSTATE, 0 for all
+    int traced; // -1 for either, otherwise required value
+    const char *cmd; // Required command line substring, or NULL
+    int lo, hi; // Inclusive deet ID range
+    bool single; // A lone ID was given
+    SORT_KEY sort;
+} ShowFilter;
+
+static SORT_KEY sort_key;
+
+static int cmp_rows(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    int d = 0;
+    switch (sort_key) {
+        case SORT_PID:
+            d = (ptable.pid[x] > ptable.pid[y]) - (ptable.pid[x] < ptable.pid[y]);
+            break;
+        case SORT_STATE:
+            d = (int)ptable.state[x] - (int)ptable.state[y];
+            break;
+        case SORT_CMD:
+            d = strcmp(ptable_command_line(x), ptable_command_line(y));
+            break;
+        case SORT_ID:
+            break;
+    }
+    return d ? d : x - y;
+}
+
+static int parse_states(const char *list, unsigned *states) {
+    char *copy = strdup(list);
+    if (copy == NULL) return -1;
+    int ret = 0;
+    for (char *save, *name = strtok_r(copy, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        int s = pstate_parse(name);
+        if (s == -1) {
+            ret = -1;
+            break;
+        }
+        *states |= 1u << s;
+    }
+    free(copy);
+    return ret;
+}
+
+static int parse_filter(char **args, ShowFilter *f) {
+    memset(f, 0, sizeof(*f));
+    f->traced = -1;
+    f->lo = 0;
+    f->hi = ptable.count - 1;
+    for (int i = 0; args[i] != NULL; i++) {
+        char *arg = args[i], *end;
+        if (strncmp(arg, "state=", 6) == 0) {
+            if (parse_states(arg + 6, &f->states) == -1) return -1;
+        } else if (strcmp(arg, "traced") == 0) {
+            f->traced = 1;
+        } else if (strcmp(arg, "untraced") == 0) {
+            f->traced = 0;
+        } else if (strncmp(arg, "cmd=", 4) == 0) {
+            f->cmd = arg + 4;
+        } else if (strncmp(arg, "sort=", 5) == 0) {
+            const char *key = arg + 5;
+            if (strcmp(key, "id") == 0) f->sort = SORT_ID;
+            else if (strcmp(key, "pid") == 0) f->sort = SORT_PID;
+            else if (strcmp(key, "state") == 0) f->sort = SORT_STATE;
+            else if (strcmp(key, "cmd") == 0) f->sort = SORT_CMD;
+            else return -1;
+        } else {
+            long lo = strtol(arg, &end, 10);
+            if (end == arg || lo < 0) return -1;
+            long hi = lo;
+            if (*end == '-') {
+                char *num = end + 1;
+                hi = strtol(num, &end, 10);
+                if (end == num || hi < lo) return -1;
+            } else {
+                f->single = true;
+            }
+            if (*end != 0) return -1;
+            f->lo = lo;
+            f->hi = hi < ptable.count ? hi : ptable.count - 1;
+        }
+    }
+    return 0;
+}
+
+static bool matches(ShowFilter *f, int id) {
+    if (id < f->lo || id > f->hi) return false;
+    if (f->traced != -1 && ptable.traced[id] != (f->traced == 1)) return false;
+    if (f->cmd != NULL && strstr(ptable_command_line(id), f->cmd) == NULL) return false;
+    return true;
+}
+
+/*
+ * Append the selected rows to sb.  Returns -1 if the arguments do not
+ * parse, in which case nothing is appended.
+ */
+int show_processes(StrBuf *sb, char **args) {
+    ShowFilter f;
+    if (parse_filter(args, &f) == -1) return -1;
+
+    int *rows = NULL;
+    int nrows = 0;
+    if (ptable.count > 0 && (rows = malloc(ptable.count * sizeof(int))) == NULL) return -1;
+
+    if (f.states == 0) {
+        for (int id = f.lo; id <= f.hi; id++) {
+            if (matches(&f, id)) rows[nrows++] = id;
+        }
+    } else {
+        for (int s = 0; s < NUM_PSTATES; s++) {
+            if (!(f.states & (1u << s))) continue;
+            for (int id = ptable.state_head[s]; id != -1; id = ptable.state_next[id]) {
+                if (matches(&f, id)) rows[nrows++] = id;
+            }
+        }
+    }
+
+    if (nrows > 1 && (f.sort != SORT_ID || f.states != 0)) {
+        sort_key = f.sort;
+        qsort(rows, nrows, sizeof(int), cmp_rows);
+    }
+
+    for (int i = 0; i < nrows; i++) {
+        int id = rows[i];
+        sb_printf(sb, "%d\t%d\t%c\t%s\t\t%s\n", id, ptable.pid[id],
+                  ptable.traced[id] ? 'T' : ptable.child[id] ? 'U' : '-', pstate_name(ptable.state[id]),
+                  ptable_command_line(id));
+    }
+    if (nrows == 0) {
+        if (f.single) {
+            sb_printf(sb, "No process found with Deet ID: %d\n", f.lo);
+        } else if (ptable.count == 0) {
+            sb_printf(sb, "No processes are currently being managed.\n");
+        } else {
+            sb_printf(sb, "No matching processes.\n");
+        }
+    }
+    free(rows);
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "statefile.h"
+#include "helper.h"
+#include "debug.h"
+
+#define STATEFILE_INITIAL 64
+
+static StateFile *state; // Mapping of the whole file, NULL when not persisting
+static size_t state_size;
+static int state_fd = -1;
+
+static size_t file_size(uint32_t capacity) {
+    return sizeof(StateFile) + (size_t)capacity * sizeof(StateRecord);
+}
+
+static int statefile_map(size_t size) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+    if (p == MAP_FAILED) return -1;
+    state = p;
+    state_size = size;
+    return 0;
+}
+
+static int statefile_grow(uint32_t need) {
+    uint32_t capacity = state->capacity * 2;
+    if (capacity < need) capacity = need;
+    size_t size = file_size(capacity);
+    if (ftruncate(state_fd, size) == -1) return -1;
+    munmap(state, state_size);
+    state = NULL;
+    if (statefile_map(size) == -1) return -1;
+    state->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Map the state file at path, creating or reinitializing it if it does
+ * not hold a valid table.  Records already in it stay readable through
+ * statefile_record() until they are overwritten.  Fails with EBUSY if
+ * another deet holds the file.
+ */
+int statefile_open(const char *path) {
+    statefile_close();
+    if ((state_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) return -1;
+    // A record lock goes with deet when it exits, even by crashing, and
+    // unlike flock() is not inherited by a child stopped before its exec
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+    if (fcntl(state_fd, F_SETLK, &lock) == -1) {
+        if (errno == EACCES || errno == EAGAIN) errno = EBUSY;
+        goto fail;
+    }
+
+    struct stat st;
+    if (fstat(state_fd, &st) == -1) goto fail;
+    size_t size = st.st_size;
+    bool valid = size >= sizeof(StateFile);
+    if (valid) {
+        StateFile hdr;
+        valid = pread(state_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                hdr.magic == STATEFILE_MAGIC && hdr.version == STATEFILE_VERSION &&
+                hdr.count <= hdr.capacity && file_size(hdr.capacity) <= size;
+    }
+    if (!valid) {
+        size = file_size(STATEFILE_INITIAL);
+        if (ftruncate(state_fd, 0) == -1 || ftruncate(state_fd, size) == -1) goto fail;
+    }
+    if (statefile_map(size) == -1) goto fail;
+    if (!valid) {
+        state->magic = STATEFILE_MAGIC;
+        state->version = STATEFILE_VERSION;
+        state->count = 0;
+        state->capacity = STATEFILE_INITIAL;
+    }
+    return 0;
+fail:
+    close(state_fd);
+    state_fd = -1;
+    return -1;
+}
+
+int statefile_count(void) {
+    return state != NULL ? (int)state->count : 0;
+}
+
+const StateRecord *statefile_record(int deet_id) {
+    if (state == NULL || deet_id < 0 || (uint32_t)deet_id >= state->count) return NULL;
+    return &state->records[deet_id];
+}
+
+/*
+ * Copy one process table entry into the file.  /proc is only consulted
+ * when the entry refers to a new process.
+ */
+void statefile_sync(int deet_id) {
+    if (state == NULL) return;
+    if ((uint32_t)deet_id >= state->capacity && statefile_grow(deet_id + 1) == -1) {
+        warn("Cannot grow state file, persistence disabled");
+        statefile_close();
+        return;
+    }
+    StateRecord *r = &state->records[deet_id];
+    if ((uint32_t)deet_id >= state->count || r->pid != ptable.pid[deet_id]) {
+        r->pid = ptable.pid[deet_id];
+        r->start_time = proc_start_time(r->pid, NULL);
+    }
+    r->deet_id = deet_id;
+    r->state = ptable.state[deet_id];
+    r->traced = ptable.traced[deet_id];
+    if ((uint32_t)deet_id >= state->count) state->count = deet_id + 1;
+}
+
+void statefile_close(void) {
+    if (state != NULL) munmap(state, state_size);
+    if (state_fd != -1) close(state_fd);
+    state = NULL;
+    state_fd = -1;
+}
+
+/*
+ * Start time of pid in clock ticks after boot, and optionally its state
+ * letter, from /proc/<pid>/stat.  Returns 0 if the process is gone.
+ */
+uint64_t proc_start_time(pid_t pid, char *pstate) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buf[n] = 0;
+
+    // The command name may contain anything, so start after its last ')'
+    char *p = strrchr(buf, ')');
+    if (p == NULL || p[1] != ' ') return 0;
+    p += 2;
+    if (pstate != NULL) *pstate = *p;
+    for (int field = 3; field < 22; field++) {
+        if ((p = strchr(p, ' ')) == NULL) return 0;
+        p++;
+    }
+    return strtoull(p, NULL, 10);
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "deet.h"
+#include "stats.h"
+#include "debug.h"
+
+uint64_t stats_counters[NUM_COUNTERS];
+StatHist stats_hists[NUM_HISTS];
+
+static const char *counter_names[NUM_COUNTERS] = {
+    "sigchld", "stopped", "continued", "exited", "spawned", "commands"
+};
+
+static const char *hist_names[NUM_HISTS] = {
+    "state_update", "ptrace", "process_vm", "signal", "log_write"
+};
+
+// Clock reference used to convert ticks to nanoseconds when printing.
+static uint64_t calib_ticks;
+static uint64_t calib_ns;
+
+static char *dump_path;
+static volatile sig_atomic_t dump_pending = 0;
+
+// Not slewed by NTP, so it keeps in step with the TSC
+static uint64_t raw_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Nanoseconds per tick, over everything since stats_init().  It is worked
+ * out again for each print, so it only gets closer the longer deet runs;
+ * both clocks are read back to back, so even right after startup it is
+ * off by no more than a read of each.
+ */
+static double ns_per_tick(void) {
+    uint64_t dt = stats_clock() - calib_ticks;
+    uint64_t dns = raw_ns() - calib_ns;
+    return dt ? (double)dns / dt : 1.0;
+}
+
+// Upper bound of the bucket containing the given rank, in ticks, or the
+// largest value seen if that is lower.
+static uint64_t hist_quantile(StatHist *h, double q) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(q * h->count);
+    if (rank >= h->count) rank = h->count - 1;
+    uint64_t seen = 0;
+    int b = 0;
+    while (b < STATS_BUCKETS - 1 && (seen += h->buckets[b]) <= rank) b++;
+    uint64_t bound = b == 0 ? 0 : 1ull << b;
+    return bound < h->max ? bound : h->max;
+}
+
+static void alarm_handler(int sig) {
+    dump_pending = 1;
+}
+
+void stats_init(void) {
+    calib_ticks = stats_clock();
+    calib_ns = raw_ns();
+}
+
+void stats_reset(void) {
+    memset(stats_counters, 0, sizeof(stats_counters));
+    memset(stats_hists, 0, sizeof(stats_hists));
+}
+
+void stats_print(StrBuf *out) {
+    double scale = ns_per_tick();
+    sb_printf(out, "counter\t\tcount\n");
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        sb_printf(out, "%-12s\t%llu\n", counter_names[i], (unsigned long long)stats_counters[i]);
+    }
+    sb_printf(out, "latency\t\tcount\tmean_ns\tp50_ns\tp99_ns\tmax_ns\n");
+    for (int i = 0; i < NUM_HISTS; i++) {
+        StatHist *h = &stats_hists[i];
+        sb_printf(out, "%-12s\t%llu\t%.0f\t%.0f\t%.0f\t%.0f\n", hist_names[i],
+                (unsigned long long)h->count,
+                h->count ? h->sum * scale / h->count : 0.0,
+                hist_quantile(h, 0.50) * scale,
+                hist_quantile(h, 0.99) * scale,
+                h->max * scale);
+    }
+}
+
+/*
+ * Write all counters and histograms in the Prometheus text exposition
+ * format.  The file is replaced atomically so a scraper never sees a
+ * partial dump.
+ *
+ * Histograms always have the same buckets, le = 2^k ns for every k, so a
+ * scraper sees the same series from dump to dump.  Each counts the
+ * samples whose tick bucket lies wholly below le, which never overstates
+ * the true count.
+ */
+int stats_write_prometheus(const char *path) {
+    size_t len = strlen(path);
+    char *tmp = malloc(len + 5);
+    if (tmp == NULL) return -1;
+    snprintf(tmp, len + 5, "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        free(tmp);
+        return -1;
+    }
+    double ns = ns_per_tick();
+    double scale = ns / 1e9;
+    fprintf(f, "# TYPE deet_events_total counter\n");
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        fprintf(f, "deet_events_total{event=\"%s\"} %llu\n",
+                counter_names[i], (unsigned long long)stats_counters[i]);
+    }
+    fprintf(f, "# TYPE deet_latency_seconds histogram\n");
+    for (int i = 0; i < NUM_HISTS; i++) {
+        StatHist *h = &stats_hists[i];
+        uint64_t cumulative = 0;
+        int b = 0;
+        for (int k = 0; k < STATS_BUCKETS; k++) {
+            double le = (double)(1ull << k);
+            for (; b < STATS_BUCKETS - 1 && (double)(1ull << b) * ns <= le; b++) {
+                cumulative += h->buckets[b];
+            }
+            fprintf(f, "deet_latency_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n",
+                    hist_names[i], le / 1e9, (unsigned long long)cumulative);
+        }
+        fprintf(f, "deet_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+                hist_names[i], (unsigned long long)h->count);
+        fprintf(f, "deet_latency_seconds_sum{op=\"%s\"} %.9f\n", hist_names[i], h->sum * scale);
+        fprintf(f, "deet_latency_seconds_count{op=\"%s\"} %llu\n",
+                hist_names[i], (unsigned long long)h->count);
+    }
+    int err = ferror(f);
+    if (fclose(f) != 0 || err || rename(tmp, path) == -1) {
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+/*
+ * Dump to path every interval_secs seconds.  SIGALRM only sets a flag;
+ * the dump itself happens from stats_service() in the main loop.
+ */
+int stats_start_dump(const char *path, int interval_secs) {
+    if (interval_secs <= 0) return -1;
+    stats_stop_dump();
+    if ((dump_path = strdup(path)) == NULL) return -1;
+
+    struct sigaction sa;
+    sa.sa_handler = alarm_handler;
+    // poll() is never restarted, so an idle event loop still wakes to dump
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGALRM, &sa, NULL) == -1) {
+        stats_stop_dump();
+        return -1;
+    }
+    struct itimerval it;
+    it.it_interval.tv_sec = interval_secs;
+    it.it_interval.tv_usec = 0;
+    it.it_value = it.it_interval;
+    if (setitimer(ITIMER_REAL, &it, NULL) == -1) {
+        stats_stop_dump();
+        return -1;
+    }
+    return stats_write_prometheus(dump_path);
+}
+
+void stats_stop_dump(void) {
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_REAL, &it, NULL);
+    free(dump_path);
+    dump_path = NULL;
+    dump_pending = 0;
+}
+
+void stats_service(void) {
+    if (!dump_pending) return;
+    dump_pending = 0;
+    if (dump_path != NULL && stats_write_prometheus(dump_path) == -1) {
+        warn("stats dump to %s failed", dump_path);
+    }
+}
+
+/*
+ * The logging functions of lib/logger.o, timed.  Every binary is linked
+ * with --wrap for each of them (LOG_WRAP in the Makefile), so all calls
+ * come through here.
+ */
+void __real_log_startup(void);
+void __real_log_shutdown(void);
+void __real_log_prompt(void);
+void __real_log_error(char *msg);
+void __real_log_state_change(pid_t pid, PSTATE old, PSTATE new, int status);
+void __real_log_signal(int sig);
+void __real_log_input(char *line);
+
+void __wrap_log_startup(void) {
+    STATS_TIMED(HIST_LOG_WRITE, __real_log_startup());
+}
+
+void __wrap_log_shutdown(void) {
+    STATS_TIMED(HIST_LOG_WRITE, __real_log_shutdown());
+}
+
+void __wrap_log_prompt(void) {
+    STATS_TIMED(HIST_LOG_WRITE, __real_log_prompt());
+}
+
+void __wrap_log_error(char *msg) {
+    STATS_TIMED(HIST_LOG_WRITE, __real_log_error(msg));
+}
+
+void __wrap_log_state_change(pid_t pid, PSTATE old, PSTATE new, int status) {
+    STATS_TIMED(HIST_LOG_WRITE, __real_log_state_change(pid, old, new, status));
+}
+
+void __wrap_log_signal(int sig) {
+    STATS_TIMED(HIST_LOG_WRITE, __real_log_signal(sig));
+}
+
+void __wrap_log_input(char *line) {
+    STATS_TIMED(HIST_LOG_WRITE, __real_log_input(line));
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include "strbuf.h"
+
+#define SB_INITIAL_SIZE 1024
+
+static int sb_reserve(StrBuf *sb, size_t extra) {
+    if (sb->len + extra <= sb->capacity) return 0;
+    size_t capacity = sb->capacity ? sb->capacity : SB_INITIAL_SIZE;
+    while (sb->len + extra > capacity) capacity *= 2;
+    char *data = realloc(sb->data, capacity);
+    if (data == NULL) return -1;
+    sb->data = data;
+    sb->capacity = capacity;
+    return 0;
+}
+
+int sb_append(StrBuf *sb, const char *data, size_t len) {
+    if (sb_reserve(sb, len) == -1) return -1;
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+    return 0;
+}
+
+int sb_printf(StrBuf *sb, const char *fmt, ...) {
+    va_list ap;
+    size_t avail = sb->capacity - sb->len;
+    va_start(ap, fmt);
+    int n = vsnprintf(sb->data ? sb->data + sb->len : NULL, avail, fmt, ap);
+    va_end(ap);
+    if (n < 0) return -1;
+    if ((size_t)n >= avail) {
+        // Did not fit: grow and format again
+        if (sb_reserve(sb, n + 1) == -1) return -1;
+        va_start(ap, fmt);
+        vsnprintf(sb->data + sb->len, n + 1, fmt, ap);
+        va_end(ap);
+    }
+    sb->len += n;
+    return n;
+}
+
+/*
+ * Write the whole buffer to fd.  Normally this is one write(); only a
+ * short write or EINTR causes another.
+ */
+int sb_write(StrBuf *sb, int fd) {
+    size_t off = 0;
+    while (off < sb->len) {
+        ssize_t n = write(fd, sb->data + off, sb->len - off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+void sb_clear(StrBuf *sb) {
+    sb->len = 0;
+}
+
+void sb_free(StrBuf *sb) {
+    free(sb->data);
+    sb->data = NULL;
+    sb->len = sb->capacity = 0;
+}
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include "trace.h"
+#include "helper.h"
+#include "statefile.h"
+#include "cgroup.h"
+#include "cover.h"
+#include "stats.h"
+#include "debug.h"
+#include "deet.h"
+
+static long do_ptrace(int request, pid_t pid, long data) {
+    long rc;
+    STATS_TIMED(HIST_PTRACE, rc = ptrace(request, pid, NULL, (void *)data));
+    return rc;
+}
+
+/*
+ * Read /proc/<pid>/cmdline.  Returns the buffer holding the strings, which
+ * *argv points into; the caller frees both.  A process without a command
+ * line (a kernel thread, or a zombie) gets an empty argv.
+ */
+char *proc_cmdline(pid_t pid, int *argc, char ***argv) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    size_t len = 0, size = 256;
+    char *buf = malloc(size);
+    for (;;) {
+        if (buf == NULL) break;
+        ssize_t n = read(fd, buf + len, size - len - 1);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) {
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        if (n == 0) break;
+        len += n;
+        if (len + 1 == size) {
+            char *p = realloc(buf, size *= 2);
+            if (p == NULL) free(buf);
+            buf = p;
+        }
+    }
+    close(fd);
+    if (buf == NULL) return NULL;
+    buf[len] = 0;
+
+    int n = 0;
+    for (size_t i = 0; i < len; i += strlen(buf + i) + 1) n++;
+    if ((*argv = malloc((n + 1) * sizeof(char *))) == NULL) {
+        free(buf);
+        return NULL;
+    }
+    n = 0;
+    for (size_t i = 0; i < len; i += strlen(buf + i) + 1) (*argv)[n++] = buf + i;
+    (*argv)[n] = NULL;
+    *argc = n;
+    return buf;
+}
+
+/*
+ * Wait for a seized process to enter a ptrace stop.  A pending signal it
+ * was about to receive is returned in *sig so it can be passed on.  If
+ * the process terminates instead, its table entry is updated and -1 is
+ * returned.
+ */
+static int wait_stop(int deet_id, int *sig) {
+    pid_t pid = ptable.pid[deet_id];
+    int status;
+    for (;;) {
+        if (waitpid(pid, &status, __WALL) == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (WIFSTOPPED(status)) {
+            if (status >> 16 != PTRACE_EVENT_STOP) *sig = WSTOPSIG(status);
+            return 0;
+        }
+        handle_wait_status(pid, status);
+        errno = ESRCH;
+        return -1;
+    }
+}
+
+static int detach(int deet_id, bool stopped) {
+    int sig = 0;
+    if (!stopped) {
+        if (do_ptrace(PTRACE_INTERRUPT, ptable.pid[deet_id], 0) == -1) return -1;
+        if (wait_stop(deet_id, &sig) == -1) return -1;
+    }
+    cover_release(deet_id, &sig);
+    if (do_ptrace(PTRACE_DETACH, ptable.pid[deet_id], sig) == -1) return -1;
+    ptable.seized[deet_id] = false;
+    return 0;
+}
+
+/*
+ * Seize an existing table entry, and optionally interrupt it.  The stop
+ * is reported later through handle_sigchld(); until then the process is
+ * left stopping.
+ */
+int trace_seize(int deet_id, bool stop) {
+    pid_t pid = ptable.pid[deet_id];
+    if (!ptable.seized[deet_id]) {
+        if (do_ptrace(PTRACE_SEIZE, pid, 0) == -1) return -1;
+        ptable.seized[deet_id] = true;
+    }
+    ptable.traced[deet_id] = true;
+    if (stop && ptable.state[deet_id] != PSTATE_STOPPED) {
+        // A process already stopped is trapped by the seize itself; an
+        // interrupt as well would be left pending and take the next cont
+        char pstate = 0;
+        bool trapped = proc_start_time(pid, &pstate) != 0 && (pstate == 'T' || pstate == 't');
+        if (!trapped && do_ptrace(PTRACE_INTERRUPT, pid, 0) == -1) return -1;
+        PSTATE old = ptable.state[deet_id];
+        ptable_set_state(deet_id, PSTATE_STOPPING);
+        log_state_change(pid, old, PSTATE_STOPPING, 0);
+    } else {
+        statefile_sync(deet_id);
+    }
+    return 0;
+}
+
+/*
+ * Start managing a process deet did not create, and stop it.  Returns its
+ * deet ID, or -1 with errno set.
+ */
+int trace_attach(pid_t pid) {
+    if (pid <= 0 || pid == getpid()) {
+        errno = EINVAL;
+        return -1;
+    }
+    int existing = ptable_find(pid);
+    if (existing != -1 && ptable.state[existing] != PSTATE_DEAD) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    int argc = 0;
+    char **argv = NULL;
+    char *cmdline = proc_cmdline(pid, &argc, &argv);
+    if (cmdline == NULL) {
+        errno = ESRCH;
+        return -1;
+    }
+    if (do_ptrace(PTRACE_SEIZE, pid, 0) == -1) {
+        free(argv);
+        free(cmdline);
+        return -1;
+    }
+    int deet_id = ptable_add(pid, argc, argv);
+    free(argv);
+    free(cmdline);
+    if (deet_id == -1) {
+        // Cannot track it, so do not hold on to it either; it is running
+        int status, sig = 0;
+        if (ptrace(PTRACE_INTERRUPT, pid, NULL, NULL) == 0 &&
+            waitpid(pid, &status, __WALL) == pid && WIFSTOPPED(status)) {
+            if (status >> 16 != PTRACE_EVENT_STOP) sig = WSTOPSIG(status);
+            ptrace(PTRACE_DETACH, pid, NULL, (void *)(long)sig);
+        }
+        errno = ENOMEM;
+        return -1;
+    }
+    ptable.seized[deet_id] = true;
+    ptable.child[deet_id] = false;
+    log_state_change(pid, PSTATE_NONE, PSTATE_RUNNING, 0);
+    if (trace_seize(deet_id, true) == -1) {
+        // It has already exited; handle_sigchld() will reap it
+        warn("Cannot interrupt process %d", (int)pid);
+    }
+    return deet_id;
+}
+
+/*
+ * Put a seized, running process into a ptrace stop and wait for it, for
+ * changes that must not race with it running.  A signal it was about to
+ * take is held back and returned in *sig for trace_resume(), so that the
+ * stop it ends in is the interrupt itself and none is left pending.  A
+ * process the table already has as stopped has a SIGSTOP on its way
+ * (run sends it), which is waited for instead.
+ */
+int trace_pause(int deet_id, int *sig) {
+    *sig = 0;
+    if (ptable.state[deet_id] == PSTATE_STOPPED && !group_frozen(deet_id)) {
+        return wait_stop(deet_id, sig);
+    }
+    if (do_ptrace(PTRACE_INTERRUPT, ptable.pid[deet_id], 0) == -1) return -1;
+    for (;;) {
+        int pending = 0;
+        if (wait_stop(deet_id, &pending) == -1) return -1;
+        if (pending == 0) return 0;
+        if (*sig == 0) *sig = pending;
+        if (do_ptrace(PTRACE_CONT, ptable.pid[deet_id], 0) == -1) return -1;
+    }
+}
+
+int trace_resume(int deet_id, int sig) {
+    return do_ptrace(PTRACE_CONT, ptable.pid[deet_id], sig) == -1 ? -1 : 0;
+}
+
+int trace_cont(int deet_id) {
+    return do_ptrace(PTRACE_CONT, ptable.pid[deet_id], 0) == -1 ? -1 : 0;
+}
+
+/*
+ * A seized process stopped.  Group stops and PTRACE_INTERRUPT stops are
+ * real stops; anything else is a signal on its way to the process, which
+ * is delivered right away.  Returns true in that case.
+ */
+bool trace_pass_signal(int deet_id, int status) {
+    if (status >> 16 == PTRACE_EVENT_STOP) return false;
+    do_ptrace(PTRACE_CONT, ptable.pid[deet_id], WSTOPSIG(status));
+    return true;
+}
+
+/*
+ * Stop tracing a process and let it run.  A seized process is detached;
+ * one that deet started is simply continued.
+ */
+int trace_release(int deet_id) {
+    pid_t pid = ptable.pid[deet_id];
+    PSTATE old = ptable.state[deet_id];
+    if (ptable.seized[deet_id]) {
+        if (detach(deet_id, old == PSTATE_STOPPED) == -1) return -1;
+        // Detaching does not end a group stop
+        char pstate = 0;
+        if (proc_start_time(pid, &pstate) != 0 && pstate == 'T') {
+            STATS_TIMED(HIST_SIGNAL, kill(pid, SIGCONT));
+        }
+    } else {
+        int rc;
+        STATS_TIMED(HIST_SIGNAL, rc = kill(pid, SIGCONT));
+        if (rc == -1) return -1;
+    }
+    ptable.traced[deet_id] = false;
+    ptable_set_state(deet_id, PSTATE_RUNNING);
+    if (old != PSTATE_RUNNING) {
+        log_state_change(pid, old, PSTATE_RUNNING, 0);
+    }
+    return 0;
+}
+
+/*
+ * deet is going away and leaving the processes it traces running, as the
+ * server does on shutdown.  The kernel would detach them with any
+ * coverage breakpoints still in, to die on the next one, so covered
+ * processes are detached first.  They stay traced in the table and the
+ * state file, for the next deet to seize again.
+ */
+void trace_shutdown(void) {
+    for (int i = 0; i < ptable.count; i++) {
+        if (ptable.state[i] == PSTATE_DEAD || !ptable.seized[i] || !cover_active(i)) continue;
+        if (detach(i, ptable.state[i] == PSTATE_STOPPED) == -1) {
+            warn("Cannot take the breakpoints out of process %d", (int)ptable.pid[i]);
+        }
+    }
+}
+
+/*
+ * Rebuild the process table from the state file at path, re-seize every
+ * traced process that still exists and stop again the ones that were
+ * stopped.  Processes that are gone, or whose PID has been reused, come
+ * back dead so that deet IDs stay the same.  The file is kept up to date
+ * from then on.  Returns the number of processes reattached.
+ */
+int trace_restore(const char *path) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (statefile_open(path) == -1) return -1;
+
+    // Entries are rewritten as they are added back, so work from a copy
+    int n = statefile_count();
+    StateRecord *saved = NULL;
+    if (n > 0) {
+        if ((saved = malloc(n * sizeof(StateRecord))) == NULL) {
+            statefile_close();
+            return -1;
+        }
+        memcpy(saved, statefile_record(0), n * sizeof(StateRecord));
+    }
+
+    int reattached = 0;
+    for (int i = 0; i < n; i++) {
+        StateRecord *r = &saved[i];
+        char pstate = 0;
+        bool alive = r->state != PSTATE_DEAD && r->start_time != 0 &&
+                     proc_start_time(r->pid, &pstate) == r->start_time &&
+                     pstate != 'Z' && pstate != 'X';
+        int argc = 0;
+        char **argv = NULL;
+        char *cmdline = alive ? proc_cmdline(r->pid, &argc, &argv) : NULL;
+        int deet_id = ptable_add(r->pid, argc, argv);
+        free(argv);
+        free(cmdline);
+        if (deet_id == -1) break;
+
+        ptable.traced[deet_id] = r->traced;
+        ptable.child[deet_id] = false;
+        statefile_sync(deet_id);
+        if (!alive) {
+            ptable_set_state(deet_id, PSTATE_DEAD);
+            continue;
+        }
+        bool stop = r->state == PSTATE_STOPPED || r->state == PSTATE_STOPPING;
+        if (r->state != PSTATE_RUNNING) ptable_set_state(deet_id, stop ? PSTATE_RUNNING : r->state);
+        log_state_change(r->pid, PSTATE_NONE, ptable.state[deet_id], 0);
+        if (r->traced) {
+            if (trace_seize(deet_id, stop) == -1) {
+                warn("Cannot reattach to process %d", (int)r->pid);
+                continue;
+            }
+        }
+        reattached++;
+    }
+    free(saved);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    debug("Reattached %d of %d processes in %ld us", reattached, n,
+          (long)((t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000));
+    return reattached;
+}
@@ -0,0 +1,475 @@
+#include <criterion/criterion.h>
+#include <criterion/logging.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "deet.h"
+#include "test_common.h"
+
+/*
+ * "Blackbox" tests for the commands added on top of the basecode.  Input
+ * is read in one go, so each test waits for a process before looking at
+ * it.  Process output is compared with PIDs and prompts filtered out, and
+ * the log by event name only.
+ */
+
+#define OUT_FILTER "sed 's/^\\(deet> \\)*//' | awk -F'\\t' '{ print $1 \" \" $4 \" \" $6; }'"
+#define ERR_FILTER "grep '^\\[' | awk '{ print $2; }'"
+// Server transcripts: frame and notification lengths and PIDs vary
+#define ALT_FILTER "sed -E 's/^([a-z]+ (ok|err)|\\*) [0-9]+$/\\1 N/; s/^(CHANGE [0-9]+) [0-9]+/\\1/' | " \
+                   "awk -F'\\t' '{ print $1 \" \" $4 \" \" $6; }'"
+// Group lists: CPU time and memory vary, and are not there without cgroups
+#define GROUP_FILTER "sed 's/^\\(deet> \\)*//' | awk -F'\\t' '$3 ~ /^(frozen|thawed|freezing|thawing)$/ " \
+                     "{ print $1 \" \" $2 \" \" $3; next; } { print $1 \" \" $4 \" \" $6; }'"
+// Counters: SIGCHLDs for a continue and a stop can come as one
+#define STATS_FILTER "sed 's/^\\(deet> \\)*//' | awk -F'\\t' '" \
+    "$1 ~ /^(sigchld|stopped) *$/ { print $1 \" \" ($2 > 0 ? \"some\" : \"none\"); next; } " \
+    "$1 ~ /^continued *$/ { print $1; next; } " \
+    "$1 ~ /^(exited|spawned|commands) *$/ { print $1 \" \" $2; next; } " \
+    "$1 ~ /^state_update/ { print $1 \" \" ($2 > 0 ? \"some\" : \"none\") \" \" " \
+    "($6 < 1000000000 ? \"sane\" : \"stale\"); next; } " \
+    "$1 ~ /^(ptrace|process_vm|signal|log_write) *$/ { next; } " \
+    "{ print $1 \" \" $4 \" \" $6; }'"
+// Agent reports: counts, times and addresses vary, and so do C library frames
+#define AGENT_FILTER OUT_FILTER " | sed -E 's/^pid [0-9]+, .*every ([0-9]+) ms.*/pid N, every \\1 ms/; " \
+                     "/^(malloc|backtrace of)/s/[0-9]+/N/g; s|^#[0-9]+ +0x[0-9a-f]+ .*/([^/ ]+) *$|\\1|' | " \
+                     "grep -v '\\.so'"
+
+/*
+ * Connect to a server listening on sock.
+ */
+static int server_connect(char *sock) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock, sizeof(addr.sun_path) - 1);
+
+    // The server is started concurrently; give it up to 5 seconds
+    int fd = -1;
+    for (int i = 0; i < 100 && fd == -1; i++) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            close(fd);
+            fd = -1;
+            struct timespec ts = { 0, 50000000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return fd;
+}
+
+/*
+ * Act as a client of a server listening on sock: send requests, or the
+ * test's input file if requests is NULL, and save everything received,
+ * up to the server closing the connection, as the test's alt file.
+ */
+static int server_client(char *sock, char *requests) {
+    int fd = server_connect(sock);
+    if (fd == -1) return -1;
+
+    int in = requests == NULL ? open(test_infile, O_RDONLY) : -1;
+    int alt = open(test_altfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ret = (requests == NULL && in == -1) || alt == -1 ? -1 : 0;
+    char buf[4096];
+    ssize_t n;
+    if (ret == 0 && requests != NULL) {
+        n = strlen(requests);
+        if (write(fd, requests, n) != n) ret = -1;
+    }
+    while (ret == 0 && in != -1 && (n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(fd, buf, n) != n) ret = -1;
+    }
+    while (ret == 0 && (n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n == -1 ? errno != EINTR : write(alt, buf, n) != n) ret = -1;
+    }
+    if (in != -1) close(in);
+    if (alt != -1) close(alt);
+    close(fd);
+    return ret;
+}
+
+Test(feature_suite, show_filters) {
+    char *name = "show_filters";
+    setup_test(name);
+    int err = run_using_system(name, "", "", "-p", STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, err);
+    assert_file_matches_cmdfilter(name, "out", OUT_FILTER);
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER);
+}
+
+Test(feature_suite, capture_output) {
+    char *name = "capture_output";
+    setup_test(name);
+    int err = run_using_system(name, "DEET_CAPTURE_DIR=" TEST_OUT_DIR "/capture_output ", "", "-p",
+                               STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, err);
+    assert_file_matches_cmdfilter(name, "out", OUT_FILTER);
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER);
+    err = system("seq 1 5 | cmp - " TEST_OUT_DIR "/capture_output/deet-0.log");
+    cr_assert_eq(err, 0, "The captured log was not what was expected.\n");
+}
+
+/*
+ * The members must really run once thawed: true has to exit for the waits
+ * to return, whether it was stopped by a signal or by the freezer.  With
+ * cgroups, members go through stopping and continuing, so the log is
+ * compared without state changes, to hold for both.
+ */
+Test(feature_suite, group_freeze, .timeout = 10) {
+    char *name = "group_freeze";
+    setup_test(name);
+    int err = run_using_system(name, "", "", "-p", STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, err);
+    assert_file_matches_cmdfilter(name, "out", GROUP_FILTER);
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER " | grep -v 'CHANGE\\|SIGNAL'");
+}
+
+/*
+ * The stop that run sends the first tp is reported while the second is
+ * waited for, through a SIGCHLD that is not logged: it must still be
+ * counted, and the table update timed from it.  tp never exits on its
+ * own, so it cannot finish before run has stopped it.
+ */
+Test(feature_suite, stats_counters) {
+    char *name = "stats_counters";
+    setup_test(name);
+    int err = run_using_system(name, "cp testprog/tp " TEST_OUT_DIR "/stats_counters/tp && "
+                               "chmod +x " TEST_OUT_DIR "/stats_counters/tp && ", "", "-p", STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, err);
+    assert_file_matches_cmdfilter(name, "out", STATS_FILTER);
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER);
+}
+
+/*
+ * quit kills only the traced processes deet started: one it has released
+ * is left to run on its own.
+ */
+Test(feature_suite, quit_keeps_released) {
+    char *name = "quit_keeps_released";
+    setup_test(name);
+    int err = run_using_system(name, "", "", "-p", STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, err);
+    assert_file_matches_cmdfilter(name, "out", OUT_FILTER);
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER);
+    err = system("pid=$(sed 's/^\\(deet> \\)*//' " TEST_OUT_DIR "/quit_keeps_released/quit_keeps_released.out | "
+                 "awk -F'\\t' '$3 == \"U\" { print $2; }') && kill $pid");
+    cr_assert_eq(err, 0, "The released process did not survive quit.\n");
+}
+
+/*
+ * A released process comes back from the state file untraced, and not a
+ * child of the deet that restores it: show must not pass it off as one
+ * whose state is followed.  run stops its child before the exec, so the
+ * first deet can be gone before sleep has its command line: give it time.
+ */
+Test(feature_suite, restore_released) {
+    char *name = "restore_released";
+    setup_test(name);
+    int err = run_using_system(name, "printf 'run sleep 30\\nrelease 0\\nquit\\n' | " PROGNAME " -p --state "
+                               TEST_OUT_DIR "/restore_released/deet.state > /dev/null 2>&1; sleep 0.2; ", "",
+                               "-p --state " TEST_OUT_DIR "/restore_released/deet.state", STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, err);
+    assert_file_matches_cmdfilter(name, "out", "sed 's/^\\(deet> \\)*//' | "
+                                  "awk -F'\\t' '{ print $1 \" \" $3 \" \" $4 \" \" $6; }'");
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER);
+    err = system("pid=$(sed 's/^\\(deet> \\)*//' " TEST_OUT_DIR "/restore_released/restore_released.out | "
+                 "awk -F'\\t' '$3 == \"-\" { print $2; }') && kill $pid");
+    cr_assert_eq(err, 0, "The released process was not restored.\n");
+}
+
+Test(feature_suite, server_requests) {
+    char *name = "server_requests";
+    setup_test(name);
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "Could not start the server.\n");
+    if (pid == 0) {
+        int err = run_using_system(name, "", "", "--listen " TEST_OUT_DIR "/server_requests/deet.sock",
+                                   STANDARD_LIMITS);
+        _exit(err == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int err = server_client(TEST_OUT_DIR "/server_requests/deet.sock", NULL);
+    int status;
+    waitpid(pid, &status, 0);
+    cr_assert_eq(err, 0, "The server could not be reached.\n");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS,
+              "The server did not exit normally.\n");
+    assert_file_matches_cmdfilter(name, "alt", ALT_FILTER);
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER);
+}
+
+Test(feature_suite, server_keeps_file) {
+    char *name = "server_keeps_file";
+    setup_test(name);
+    int err = run_using_system(name, "echo keep > " TEST_OUT_DIR "/server_keeps_file/deet.sock; ", "",
+                               "--listen " TEST_OUT_DIR "/server_keeps_file/deet.sock", STANDARD_LIMITS);
+    assert_expected_status(EXIT_FAILURE, err);
+    err = system("grep -q keep " TEST_OUT_DIR "/server_keeps_file/deet.sock");
+    cr_assert_eq(err, 0, "The file at the socket path was removed.\n");
+}
+
+/*
+ * attach needs the PID of a process deet did not start, so the requests
+ * are made up here and sent through the server.
+ */
+Test(feature_suite, attach_release) {
+    char *name = "attach_release";
+    setup_test(name);
+    pid_t target = fork();
+    cr_assert_neq(target, -1, "Could not start the process to attach to.\n");
+    if (target == 0) {
+        execlp("sleep", "sleep", "30", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "Could not start the server.\n");
+    if (pid == 0) {
+        int err = run_using_system(name, "", "", "--listen " TEST_OUT_DIR "/attach_release/deet.sock",
+                                   STANDARD_LIMITS);
+        _exit(err == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    char requests[256];
+    snprintf(requests, sizeof(requests),
+             "a attach %d\nb wait 0 stopped\nc show\nd release 0\ne show\nf shutdown\n", (int)target);
+    int err = server_client(TEST_OUT_DIR "/attach_release/deet.sock", requests);
+    int status;
+    waitpid(pid, &status, 0);
+
+    // Released, the process must run on untraced
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "grep -q '^TracerPid:[[:space:]]*0$' /proc/%d/status && "
+             "! grep -q '^State:[[:space:]]*[Tt]' /proc/%d/status", (int)target, (int)target);
+    int released = system(cmd);
+    kill(target, SIGKILL);
+    waitpid(target, NULL, 0);
+
+    cr_assert_eq(err, 0, "The server could not be reached.\n");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS,
+              "The server did not exit normally.\n");
+    cr_assert_eq(released, 0, "The released process is still traced or stopped.\n");
+    assert_file_matches_cmdfilter(name, "alt", ALT_FILTER);
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER);
+}
+
+/*
+ * tp stops itself after each call of f(), so once it has been seen
+ * stopped, every cont goes round the loop in e() and through f() and
+ * nothing else in it: coverage is started on it attached there, to get
+ * the same blocks every time.
+ */
+Test(feature_suite, cover_dump) {
+    char *name = "cover_dump";
+    setup_test(name);
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "Could not start the server.\n");
+    if (pid == 0) {
+        // The server is a child of the test, so that it can attach to tp
+        int err = run_using_system(name, "", "", "--listen " TEST_OUT_DIR "/cover_dump/deet.sock", STANDARD_LIMITS);
+        _exit(err == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    // Starting the server empties the test's directory: put tp there after
+    for (int i = 0; i < 100 && access(TEST_OUT_DIR "/cover_dump/deet.sock", F_OK) == -1; i++) {
+        struct timespec ts = { 0, 50000000 };
+        nanosleep(&ts, NULL);
+    }
+    int err = system("cp testprog/tp " TEST_OUT_DIR "/cover_dump/tp && chmod +x " TEST_OUT_DIR "/cover_dump/tp");
+    cr_assert_eq(err, 0, "Could not set up the program to cover.\n");
+    pid_t target = fork();
+    cr_assert_neq(target, -1, "Could not start the process to cover.\n");
+    if (target == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null != -1) dup2(null, STDERR_FILENO);
+        execl(TEST_OUT_DIR "/cover_dump/tp", "tp", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(target, &status, WUNTRACED);
+    cr_assert(WIFSTOPPED(status), "The process to cover did not stop.\n");
+
+    char requests[256];
+    snprintf(requests, sizeof(requests),
+             "a attach %d\nb wait 0 stopped\nc cover 0\nd cont 0\ne wait 0 stopped\nf cover 0\n"
+             "g cover 0 dump " TEST_OUT_DIR "/cover_dump/tp.drcov\nh release 0\ni cover 0\nj shutdown\n",
+             (int)target);
+    err = server_client(TEST_OUT_DIR "/cover_dump/deet.sock", requests);
+    waitpid(pid, &status, 0);
+
+    // Released, tp must have had the breakpoints not hit taken out
+    kill(target, SIGKILL);
+    int target_status;
+    while (waitpid(target, &target_status, 0) == -1 && errno == EINTR) ;
+
+    cr_assert_eq(err, 0, "The server could not be reached.\n");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS,
+              "The server did not exit normally.\n");
+    cr_assert(WIFSIGNALED(target_status) && WTERMSIG(target_status) == SIGKILL,
+              "The released process was killed by a breakpoint.\n");
+    assert_file_matches_cmdfilter(name, "alt", ALT_FILTER " | sed 's|/.*/||'");
+    // How many SIGCHLDs the traps and stops come in varies
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER " | grep -v SIGNAL");
+    // The loop in e(), f() up to its stack check, and f()'s return
+    err = system("grep -aq '^BB Table: 3 bbs$' " TEST_OUT_DIR "/cover_dump/tp.drcov && "
+                 "tail -c 24 " TEST_OUT_DIR "/cover_dump/tp.drcov | od -An -tu4 -w8 | awk '{ print $1; }' | "
+                 "grep -qx \"$((0x$(nm testprog/tp | awk '$3 == \"f\" { print $1; }')))\"");
+    cr_assert_eq(err, 0, "The coverage dump was not what was expected.\n");
+}
+
+/*
+ * The server leaves what it traces running when it shuts down.  tp, left
+ * stopped with coverage on, must go round its loop again once continued,
+ * rather than die on a breakpoint left in it.
+ */
+Test(feature_suite, cover_shutdown) {
+    char *name = "cover_shutdown";
+    setup_test(name);
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "Could not start the server.\n");
+    if (pid == 0) {
+        int err = run_using_system(name, "", "", "--listen " TEST_OUT_DIR "/cover_shutdown/deet.sock",
+                                   STANDARD_LIMITS);
+        _exit(err == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    for (int i = 0; i < 100 && access(TEST_OUT_DIR "/cover_shutdown/deet.sock", F_OK) == -1; i++) {
+        struct timespec ts = { 0, 50000000 };
+        nanosleep(&ts, NULL);
+    }
+    int err = system("cp testprog/tp " TEST_OUT_DIR "/cover_shutdown/tp && chmod +x " TEST_OUT_DIR "/cover_shutdown/tp");
+    cr_assert_eq(err, 0, "Could not set up the program to cover.\n");
+    pid_t target = fork();
+    cr_assert_neq(target, -1, "Could not start the process to cover.\n");
+    if (target == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null != -1) dup2(null, STDERR_FILENO);
+        execl(TEST_OUT_DIR "/cover_shutdown/tp", "tp", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(target, &status, WUNTRACED);
+    cr_assert(WIFSTOPPED(status), "The process to cover did not stop.\n");
+
+    char requests[128];
+    snprintf(requests, sizeof(requests), "a attach %d\nb wait 0 stopped\nc cover 0\nd shutdown\n", (int)target);
+    err = server_client(TEST_OUT_DIR "/cover_shutdown/deet.sock", requests);
+    waitpid(pid, &status, 0);
+
+    kill(target, SIGCONT);
+    int target_status;
+    while (waitpid(target, &target_status, WUNTRACED) == -1 && errno == EINTR) ;
+    kill(target, SIGKILL);
+    waitpid(target, NULL, 0);
+
+    cr_assert_eq(err, 0, "The server could not be reached.\n");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS,
+              "The server did not exit normally.\n");
+    cr_assert(WIFSTOPPED(target_status), "The process left running was killed by a breakpoint.\n");
+    assert_file_matches_cmdfilter(name, "alt", ALT_FILTER " | sed 's|/.*/||'");
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER " | grep -v SIGNAL");
+}
+
+/*
+ * tp never changes static_variable, so the test does, through tp's memory,
+ * once the monitor has taken its first sample: a later tick must record
+ * the new value as a change.
+ */
+Test(feature_suite, monitor_change) {
+    char *name = "monitor_change";
+    setup_test(name);
+    pid_t pid = fork();
+    cr_assert_neq(pid, -1, "Could not start the server.\n");
+    if (pid == 0) {
+        int err = run_using_system(name, "", "", "--listen " TEST_OUT_DIR "/monitor_change/deet.sock",
+                                   STANDARD_LIMITS);
+        _exit(err == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    for (int i = 0; i < 100 && access(TEST_OUT_DIR "/monitor_change/deet.sock", F_OK) == -1; i++) {
+        struct timespec ts = { 0, 50000000 };
+        nanosleep(&ts, NULL);
+    }
+    int err = system("cp testprog/tp " TEST_OUT_DIR "/monitor_change/tp && chmod +x " TEST_OUT_DIR "/monitor_change/tp");
+    cr_assert_eq(err, 0, "Could not set up the program to monitor.\n");
+    pid_t target = fork();
+    cr_assert_neq(target, -1, "Could not start the process to monitor.\n");
+    if (target == 0) {
+        // tp prints where static_variable is before it stops
+        int log = open(TEST_OUT_DIR "/monitor_change/tp.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log != -1) dup2(log, STDERR_FILENO);
+        execl(TEST_OUT_DIR "/monitor_change/tp", "tp", NULL);
+        _exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(target, &status, WUNTRACED);
+    cr_assert(WIFSTOPPED(status), "The process to monitor did not stop.\n");
+    void *addr = NULL;
+    char line[256];
+    FILE *log = fopen(TEST_OUT_DIR "/monitor_change/tp.log", "r");
+    while (log != NULL && addr == NULL && fgets(line, sizeof(line), log) != NULL)
+        sscanf(line, "static_variable @ %p", &addr);
+    if (log != NULL) fclose(log);
+    cr_assert_neq(addr, NULL, "The process to monitor did not say where its variable is.\n");
+
+    // Send the requests after the monitor is started only once it has answered
+    char requests[256];
+    snprintf(requests, sizeof(requests), "a attach %d\nb wait 0 stopped\nc monitor 0 %p 8 1000\n",
+             (int)target, addr);
+    int fd = server_connect(TEST_OUT_DIR "/monitor_change/deet.sock");
+    int alt = open(test_altfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    err = fd == -1 || alt == -1 ? -1 : 0;
+    if (err == 0 && write(fd, requests, strlen(requests)) != (ssize_t)strlen(requests)) err = -1;
+    char buf[4096] = "";
+    size_t got = 0;
+    ssize_t n;
+    while (err == 0 && !strstr(buf, "\nc ok") && !strstr(buf, "\nc err")) {
+        if ((n = read(fd, buf + got, sizeof(buf) - 1 - got)) <= 0) {
+            if (n == 0 || errno != EINTR) err = -1;
+            continue;
+        }
+        if (write(alt, buf + got, n) != n) err = -1;
+        buf[got += n] = 0;
+    }
+
+    unsigned long value = 0x2a;
+    snprintf(line, sizeof(line), "/proc/%d/mem", (int)target);
+    int mem = open(line, O_WRONLY);
+    if (mem == -1 || pwrite(mem, &value, sizeof(value), (off_t)(uintptr_t)addr) != sizeof(value)) err = -1;
+    if (mem != -1) close(mem);
+    struct timespec ts = { 0, 100000000 };
+    nanosleep(&ts, NULL);
+    snprintf(requests, sizeof(requests), "d monitor 0\ne release 0\nf shutdown\n");
+    if (err == 0 && write(fd, requests, strlen(requests)) != (ssize_t)strlen(requests)) err = -1;
+    while (err == 0 && (n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n == -1 ? errno != EINTR : write(alt, buf, n) != n) err = -1;
+    }
+    if (alt != -1) close(alt);
+    if (fd != -1) close(fd);
+    waitpid(pid, &status, 0);
+    kill(target, SIGKILL);
+    waitpid(target, NULL, 0);
+
+    cr_assert_eq(err, 0, "The server could not be reached.\n");
+    cr_assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS,
+              "The server did not exit normally.\n");
+    // Sample times and addresses vary, and so does how many ticks there were
+    assert_file_matches_cmdfilter(name, "alt", "sed -E 's/^[0-9]+\\.[0-9]+\t0x[0-9a-f]+\t/T A /; "
+                                  "s/[0-9]+ samples, [0-9]+ missed/N samples, N missed/' | " ALT_FILTER);
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER " | grep -v SIGNAL");
+}
+
+/*
+ * tp stops itself in a loop, so it is known to be running with the agent
+ * loaded once it has stopped.  The backtrace asked for while it is stopped
+ * is taken when it goes on, in e(), and is there once it stops again.
+ */
+Test(feature_suite, agent_backtrace) {
+    char *name = "agent_backtrace";
+    setup_test(name);
+    int err = run_using_system(name, "cp testprog/tp " TEST_OUT_DIR "/agent_backtrace/tp && "
+                               "chmod +x " TEST_OUT_DIR "/agent_backtrace/tp && ", "", "-p", STANDARD_LIMITS);
+    assert_expected_status(EXIT_SUCCESS, err);
+    assert_file_matches_cmdfilter(name, "out", AGENT_FILTER);
+    assert_file_matches_cmdfilter(name, "err", ERR_FILTER);
+}